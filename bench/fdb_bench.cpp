@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+using namespace fishdb;
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string Key(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key%010d", i);
+    return buf;
+}
+
+// drop the file from the os page cache so the next pass reads the disk
+static void DropCache(const char *file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static long FileSize(const char *file)
+{
+    FILE *fp = fopen(file, "rb");
+    if (!fp) return 0;
+    fseek(fp, 0L, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+// ns to checksum one page, averaged over the whole file image
+static double CrcCost(const std::string &image, uint32_t (*crc)(const char *, size_t, uint32_t))
+{
+    int64_t pages = image.size() / PG_SIZE;
+    uint32_t sink = 0;
+    int rounds = 0;
+    double start = Now();
+    do
+    {
+        for (int64_t i = 0; i < pages; ++i)
+            sink ^= crc(image.data() + i * PG_SIZE, PG_SIZE, 0);
+        rounds++;
+    } while (Now() - start < 0.2);
+    double ns = (Now() - start) * 1e9 / (rounds * pages);
+    if (sink == 1) printf(" ");
+    return ns;
+}
+
+// share of node key slots in use, 1 is every node full
+static double NodeFill(BTree *bt, int min_key_num)
+{
+    int64_t entries = 0, nodes = 0;
+    bt->GetProperty("fishdb.num-entries", entries);
+    bt->GetProperty("fishdb.num-nodes", nodes);
+    return nodes ? (double)entries / (nodes * 2 * min_key_num) : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *file = "bench.fdb";
+    int n = (argc > 1) ? atoi(argv[1]) : 100000;
+    int value_size = (argc > 2) ? atoi(argv[2]) : 100;
+    Options options;
+    options.min_key_num = (argc > 3) ? atoi(argv[3]) : BT_DEFAULT_KEY_NUM;
+
+    // ascending keys, as from a sequence or a clock
+    remove(file);
+    BTree *bt = BTree::Open(file, options);
+    std::string value(value_size, 'v');
+    double start = Now();
+    for (int i = 0; i < n; ++i)
+        bt->Put(Key(i), value);
+    double seq_fill = NodeFill(bt, options.min_key_num);
+    bt->Close();
+    double fillseq = Now() - start;
+    delete bt;
+    long seq_size = FileSize(file);
+
+    remove(file);
+    remove((std::string(file) + ".warm").c_str());
+    bt = BTree::Open(file, options);
+    std::vector<int> order(n);
+    for (int i = 0; i < n; ++i)
+        order[i] = i;
+    for (int i = n - 1; i > 0; --i)
+        std::swap(order[i], order[rand() % (i + 1)]);
+
+    start = Now();
+    for (int i = 0; i < n; ++i)
+        bt->Put(Key(order[i]), value);
+    double random_fill = NodeFill(bt, options.min_key_num);
+    bt->Close();
+    double fill = Now() - start;
+    delete bt;
+
+    // every page is read and verified once on a cold open
+    bt = BTree::Open(file, options);
+    start = Now();
+    std::string v;
+    for (int i = 0; i < n; ++i)
+        bt->Get(Key(order[i]), v);
+    double cold = Now() - start;
+    start = Now();
+    for (int i = 0; i < n; ++i)
+        bt->Get(Key(order[i]), v);
+    double warm = Now() - start;
+    bt->Close();
+    delete bt;
+
+    // full scan with nothing cached, readahead keeps it sequential
+    remove((std::string(file) + ".warm").c_str());
+    DropCache(file);
+    bt = BTree::Open(file, options);
+    start = Now();
+    int scanned = 0;
+    Iterator *iter = bt->NewIterator();
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next())
+        scanned++;
+    delete iter;
+    double scan = Now() - start;
+    bt->Close();
+    delete bt;
+
+    long size = FileSize(file);
+    std::string image(size, 0);
+    FILE *fp = fopen(file, "rb");
+    size_t got = fread(&image[0], 1, size, fp);
+    fclose(fp);
+    image.resize(got - got % PG_SIZE);
+    int64_t pages = image.size() / PG_SIZE;
+
+    double hw = CrcCost(image, Crc32c);
+    double sw = CrcCost(image, Crc32cPortable);
+    double verify = pages * hw / 1e9;
+
+    printf("fillseq      %10.0f ops/s  node fill %.1f%%  %.1f MB\n",
+            n / fillseq, seq_fill * 100, seq_size / 1e6);
+    printf("fillrandom   %10.0f ops/s  node fill %.1f%%  %.1f MB\n",
+            n / fill, random_fill * 100, size / 1e6);
+    printf("readcold     %10.0f ops/s  (%" PRId64 " pages in file)\n", n / cold, pages);
+    printf("readwarm     %10.0f ops/s\n", n / warm);
+    printf("scancold     %10.0f keys/s  %.1f MB/s\n", scanned / scan, size / scan / 1e6);
+    printf("crc32c       %10.1f ns/page  %s\n", hw, Crc32cHardware() ? "sse4.2" : "portable");
+    printf("crc32c sw    %10.1f ns/page\n", sw);
+    printf("verify cost  %10.3f ms  %.2f%% of readcold\n", verify * 1e3, verify * 100 / cold);
+    remove(file);
+    remove((std::string(file) + ".warm").c_str());
+    return 0;
+}
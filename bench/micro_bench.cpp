@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <new>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+using namespace fishdb;
+
+// every heap allocation is counted, allocations/op is read around a run
+static std::atomic<uint64_t> g_allocs(0);
+
+void *operator new(size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+static volatile uint64_t g_sink;
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fn does batch ops per call. Calls double until a round takes 0.2s,
+// the last round is reported
+template <class F>
+static void Run(const char *name, int batch, F fn)
+{
+    fn();
+    for (int64_t calls = 1; ; calls *= 2)
+    {
+        uint64_t allocs = g_allocs.load();
+        double start = Now();
+        for (int64_t i = 0; i < calls; ++i)
+            fn();
+        double elapsed = Now() - start;
+        if (elapsed < 0.2) continue;
+        double ops = (double)calls * batch;
+        printf("%-28s %10.1f ns/op %8.2f allocs/op\n", name,
+                elapsed * 1e9 / ops, (g_allocs.load() - allocs) / ops);
+        return;
+    }
+}
+
+// LowerBound is protected; a pointer to it taken in a derived class
+// calls it on any BTree
+struct BoundAccess: public BTree
+{
+    static size_t Call(BTree *bt, const std::shared_ptr<MemPage> &mp, const std::string &key)
+    {
+        return (bt->*(&BoundAccess::LowerBound))(mp, key);
+    }
+};
+
+static std::string Key(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key%012d", i);
+    return buf;
+}
+
+// an inner node of fanout keys 0, 2, 4, ... so probes hit and miss
+static std::shared_ptr<MemPage> MakeNode(int fanout, bool u64, int value_size)
+{
+    auto mp = std::make_shared<MemPage>();
+    memset(&mp->header, 0, sizeof(PageHeader));
+    mp->header.page_no = 1;
+    mp->header.flags = u64 ? PF_U64_KEYS : 0;
+    mp->is_leaf = false;
+    std::string value(value_size, 'v');
+    for (int i = 0; i < fanout; ++i)
+    {
+        std::string key = u64 ? EncodeU64Key(i * 2) : Key(i * 2);
+        mp->InsertKV(i, KV(key, value));
+        mp->children.push_back(i + 2);
+        mp->counts.push_back(i);
+    }
+    mp->children.push_back(fanout + 2);
+    mp->counts.push_back(fanout);
+    return mp;
+}
+
+static void BenchCodec()
+{
+    char buf[64];
+    const int batch = 1000;
+    Run("EncodeInt64", batch, [&]()
+    {
+        for (int i = 0; i < batch; ++i)
+            EncodeInt64(buf, i);
+        g_sink += buf[0];
+    });
+    Run("DecodeInt64", batch, [&]()
+    {
+        int64_t num = 0;
+        for (int i = 0; i < batch; ++i)
+        {
+            DecodeInt64(buf, num);
+            g_sink += num;
+        }
+    });
+    std::string str = Key(42);
+    Run("EncodeString 15B", batch, [&]()
+    {
+        for (int i = 0; i < batch; ++i)
+            EncodeString(buf, str);
+        g_sink += buf[4];
+    });
+    Run("DecodeString 15B", batch, [&]()
+    {
+        std::string out;
+        for (int i = 0; i < batch; ++i)
+        {
+            DecodeString(buf, out);
+            g_sink += out.size();
+        }
+    });
+    Run("EncodeU64Key", batch, [&]()
+    {
+        for (uint64_t i = 0; i < (uint64_t)batch; ++i)
+            g_sink += EncodeU64Key(i)[7];
+    });
+    std::string ukey = EncodeU64Key(0x0102030405060708ULL);
+    Run("DecodeU64Key", batch, [&]()
+    {
+        for (int i = 0; i < batch; ++i)
+            g_sink += DecodeU64Key(ukey);
+    });
+}
+
+static void BenchNode(int fanout, bool u64, int value_size)
+{
+    auto mp = MakeNode(fanout, u64, value_size);
+    std::vector<char> buf(1 << 20);
+    int size = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "Serialize %s %d x %dB", u64 ? "u64" : "bytes", fanout, value_size);
+    Run(name, 1, [&]()
+    {
+        mp->Serialize(&buf[0], size);
+        g_sink += size;
+    });
+
+    // Parse takes the image after the page header, as Pager::ReadPage feeds it
+    mp->Serialize(&buf[0], size);
+    snprintf(name, sizeof(name), "Parse %s %d x %dB", u64 ? "u64" : "bytes", fanout, value_size);
+    Run(name, 1, [&]()
+    {
+        MemPage page;
+        page.header = mp->header;
+        page.Feed(&buf[PH_SIZE], size - PH_SIZE);
+        page.Parse();
+        g_sink += page.kvs.size();
+    });
+}
+
+static void BenchLowerBound(BTree *bt, int fanout, bool u64)
+{
+    auto mp = MakeNode(fanout, u64, 8);
+    std::vector<std::string> probes;
+    srand(fanout);
+    for (int i = 0; i < 1024; ++i)
+    {
+        int k = rand() % (2 * fanout + 1);
+        probes.push_back(u64 ? EncodeU64Key(k) : Key(k));
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "LowerBound %s fanout %d", u64 ? "u64" : "bytes", fanout);
+    Run(name, probes.size(), [&]()
+    {
+        for (size_t i = 0; i < probes.size(); ++i)
+            g_sink += BoundAccess::Call(bt, mp, probes[i]);
+    });
+}
+
+// nodes of 16 keys with 100B values, about four pages each
+static void FillPages(Pager &pager, int n, std::vector<int64_t> &pgno)
+{
+    std::string value(100, 'v');
+    for (int i = 0; i < n; ++i)
+    {
+        auto mp = pager.NewPage();
+        pgno.push_back(mp->header.page_no);
+        for (int k = 0; k < 16; ++k)
+            mp->InsertKV(k, KV(Key(k), value));
+    }
+    pager.Prune(0, true);
+}
+
+static void BenchPager()
+{
+    const int N = 256;
+    const char *file = "micro.fdb";
+    remove(file);
+    Pager pager;
+    if (pager.Init(file) != 0) return;
+    std::vector<int64_t> pgno;
+    FillPages(pager, N, pgno);
+    for (int i = 0; i < N; ++i)
+        pager.GetPage(pgno[i]);
+    Run("GetPage hit", N, [&]()
+    {
+        for (int i = 0; i < N; ++i)
+            g_sink += pager.GetPage(pgno[i])->kvs.size();
+    });
+    // a budget of a few nodes, so every GetPage reads and parses
+    pager.m_capacity = 8 << 10;
+    Run("GetPage miss (+Prune)", N, [&]()
+    {
+        for (int i = 0; i < N; ++i)
+        {
+            g_sink += pager.GetPage(pgno[i])->kvs.size();
+            pager.Prune(pager.m_capacity);
+        }
+    });
+    pager.Close();
+    remove(file);
+    remove((std::string(file) + ".warm").c_str());
+}
+
+int main(int argc, char **argv)
+{
+    BenchCodec();
+    BenchNode(16, false, 100);
+    BenchNode(64, false, 16);
+    BenchNode(64, true, 16);
+
+    const char *file = "micro.fdb";
+    remove(file);
+    BTree *bt = BTree::Open(file);
+    int fanouts[] = {4, 16, 64, 256};
+    for (size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); ++i)
+        BenchLowerBound(bt, fanouts[i], false);
+    bt->Close();
+    delete bt;
+    remove(file);
+    Options options;
+    options.key_mode = KEY_U64;
+    bt = BTree::Open(file, options);
+    for (size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); ++i)
+        BenchLowerBound(bt, fanouts[i], true);
+    bt->Close();
+    delete bt;
+    remove(file);
+    remove((std::string(file) + ".warm").c_str());
+
+    BenchPager();
+    return 0;
+}
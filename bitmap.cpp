@@ -0,0 +1,157 @@
+#include <cstring>
+#include <algorithm>
+#include "bitmap.h"
+
+namespace fishdb
+{
+
+PageBitmap::PageBitmap()
+{
+    m_size = 0;
+    m_hint = 0;
+}
+
+void PageBitmap::Reset(int64_t size)
+{
+    m_words.assign((size + 63) / 64, 0);
+    m_size = size;
+    m_hint = 0;
+}
+
+void PageBitmap::Grow(int64_t size)
+{
+    if (size <= m_size) return;
+    m_words.resize((size + 63) / 64, 0);
+    m_size = size;
+}
+
+bool PageBitmap::Test(int64_t page_no)
+{
+    if (page_no >= m_size) return false;
+    return (m_words[page_no >> 6] >> (page_no & 63)) & 1;
+}
+
+bool PageBitmap::IsFree(int64_t page_no, int64_t cnt)
+{
+    for (int64_t i = page_no; i < page_no + cnt && i < m_size; ++i)
+    {
+        if (Test(i)) return false;
+    }
+    return true;
+}
+
+void PageBitmap::Set(int64_t page_no, int64_t cnt)
+{
+    Grow(page_no + cnt);
+    for (int64_t i = page_no; i < page_no + cnt; ++i)
+        m_words[i >> 6] |= 1ULL << (i & 63);
+}
+
+void PageBitmap::Clear(int64_t page_no, int64_t cnt)
+{
+    for (int64_t i = page_no; i < page_no + cnt && i < m_size; ++i)
+        m_words[i >> 6] &= ~(1ULL << (i & 63));
+    if (page_no < m_hint)
+        m_hint = page_no;
+}
+
+void PageBitmap::Truncate(int64_t size)
+{
+    if (size >= m_size) return;
+    m_words.resize((size + 63) / 64);
+    if (size & 63)
+        m_words.back() &= (1ULL << (size & 63)) - 1;
+    m_size = size;
+}
+
+int64_t PageBitmap::FindRun(int64_t cnt, int64_t floor)
+{
+    bool from_hint = floor <= m_hint;
+    int64_t p = from_hint ? m_hint : floor;
+    int64_t run = 0;
+    while (p < m_size)
+    {
+        // skip whole words of used pages
+        if (run == 0 && (p & 63) == 0 && m_words[p >> 6] == ~0ULL)
+        {
+            p += 64;
+            continue;
+        }
+        if (Test(p))
+        {
+            run = 0;
+            ++p;
+            continue;
+        }
+        if (from_hint)
+        {
+            m_hint = p;
+            from_hint = false;
+        }
+        if (++run == cnt) return p - cnt + 1;
+        ++p;
+    }
+    if (from_hint)
+        m_hint = m_size;
+    return m_size - run;
+}
+
+int64_t PageBitmap::LastUsed()
+{
+    for (int64_t w = (int64_t)m_words.size() - 1; w >= 0; --w)
+    {
+        if (m_words[w] != 0)
+            return w * 64 + 63 - __builtin_clzll(m_words[w]);
+    }
+    return -1;
+}
+
+int64_t PageBitmap::NextUsed(int64_t from)
+{
+    if (from >= m_size) return m_size;
+    int64_t w = from >> 6;
+    uint64_t bits = m_words[w] & (~0ULL << (from & 63));
+    while (bits == 0)
+    {
+        if (++w == (int64_t)m_words.size()) return m_size;
+        bits = m_words[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+void PageBitmap::Intersect(const PageBitmap &other)
+{
+    for (size_t w = 0; w < m_words.size(); ++w)
+        m_words[w] &= (w < other.m_words.size()) ? other.m_words[w] : 0;
+}
+
+void PageBitmap::Subtract(const PageBitmap &other)
+{
+    size_t n = std::min(m_words.size(), other.m_words.size());
+    for (size_t w = 0; w < n; ++w)
+        m_words[w] &= ~other.m_words[w];
+    m_hint = 0;
+}
+
+int64_t PageBitmap::FreeCount()
+{
+    int64_t used = 0;
+    for (size_t w = 0; w < m_words.size(); ++w)
+        used += __builtin_popcountll(m_words[w]);
+    return m_size - used;
+}
+
+void PageBitmap::Encode(std::string &out)
+{
+    out.assign((const char *)m_words.data(), m_words.size() * sizeof(uint64_t));
+}
+
+void PageBitmap::Decode(const char *buf, int64_t size)
+{
+    Reset(size);
+    memcpy((char *)m_words.data(), buf, m_words.size() * sizeof(uint64_t));
+    if (size & 63)
+        m_words.back() &= (1ULL << (size & 63)) - 1;
+}
+
+}
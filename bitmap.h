@@ -0,0 +1,51 @@
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace fishdb
+{
+
+// one bit per page, set when the page is in use
+class PageBitmap
+{
+public:
+    PageBitmap();
+
+    void Reset(int64_t size);
+    int64_t Size() { return m_size; }
+
+    bool Test(int64_t page_no);
+    bool IsFree(int64_t page_no, int64_t cnt);
+    void Set(int64_t page_no, int64_t cnt = 1);
+    void Clear(int64_t page_no, int64_t cnt = 1);
+    void Truncate(int64_t size);
+
+    // lowest start >= floor of cnt free pages, pages past the end
+    // count as free
+    int64_t FindRun(int64_t cnt, int64_t floor);
+    int64_t LastUsed();
+    int64_t FreeCount();
+    // lowest used page >= from, Size() if none
+    int64_t NextUsed(int64_t from);
+    // keep only the pages also used in other
+    void Intersect(const PageBitmap &other);
+    // free the pages used in other
+    void Subtract(const PageBitmap &other);
+
+    void Encode(std::string &out);
+    void Decode(const char *buf, int64_t size);
+
+private:
+    void Grow(int64_t size);
+
+    std::vector<uint64_t> m_words;
+    int64_t m_size;
+    int64_t m_hint;     // no free page below it
+};
+
+}
+
+#endif
@@ -1,3 +1,4 @@
+#include <atomic>
 #include "pager.h"
 #include "btree.h"
 
@@ -6,65 +7,357 @@ namespace fishdb
 
 BTree * BTree::Open(std::string dbfile,
         CmpFunc cmp_func, int min_key_num)
+{
+    Options options;
+    options.cmp_func = cmp_func;
+    options.min_key_num = min_key_num;
+    return Open(dbfile, options);
+}
+
+BTree * BTree::Open(std::string dbfile, const Options &options)
 {
     BTree *bt = new BTree();
-    bt->m_cmp_func = cmp_func;
-    bt->m_min_key_num = min_key_num;
+    bt->m_cmp_func = options.cmp_func;
+    bt->m_merge_op = options.merge_op;
+    bt->m_u64_keys = options.key_mode == KEY_U64;
+    // big-endian integer keys sort bytewise
+    bt->m_bytewise = bt->m_u64_keys || options.cmp_func.target<DefaultCmp>() != NULL;
+    bt->m_min_key_num = options.min_key_num;
+    bt->m_merge_key_num = std::max(1, options.min_key_num / 2);
+    bt->m_closed = false;
+    bt->m_write_seq = 0;
+    bt->m_vacuuming = false;
+    bt->m_vacuum_has_cursor = false;
+    bt->m_vacuum_stop = false;
+    bt->m_warm_stop = false;
+    bt->m_dirty_ratio = options.dirty_ratio;
+    bt->m_checkpoint_ms = options.checkpoint_interval_ms;
+    bt->m_flush_stop = false;
 
-    int ret = bt->m_pager.Init(dbfile);
+    int ret = bt->m_pager.Init(dbfile, options.cache_size, options.key_mode,
+            options.sync_mode);
     if (ret)
+    {
+        // Init closed the file again, there is nothing to write out
+        bt->m_closed = true;
+        delete bt;
         return NULL;
+    }
     bt->m_root = bt->m_pager.GetRoot();
+    bt->m_height = 1;
+    for (auto now = bt->m_root; !now->is_leaf; now = bt->ReadPage(now->children[0]))
+        bt->m_height++;
+    bt->m_pager.Prune(bt->m_pager.m_capacity);
     printf("root_page_no[%" PRId64 "]\n", bt->m_root->header.page_no);
+
+    std::vector<int64_t> warm;
+    bt->m_pager.LoadWarmList(warm);
+    if (!warm.empty())
+        bt->m_warm_thread = std::thread(&BTree::WarmupLoop, bt, warm);
+    if (bt->m_dirty_ratio < 1 || bt->m_checkpoint_ms > 0)
+        bt->m_flush_thread = std::thread(&BTree::FlushLoop, bt);
     return bt;
 }
 
+// Close stops the threads first and does nothing the second time
+BTree::~BTree()
+{
+    Close();
+}
+
+// a running thread at destruction would be std::terminate
+void BTree::StopThreads()
+{
+    StopVacuum();
+    StopFlusher();
+    {
+        std::lock_guard<RWLock> lock(m_mutex);
+        m_warm_stop = true;
+    }
+    WaitWarmup();
+}
+
 void BTree::Close()
 {
+    StopThreads();
+    std::lock_guard<RWLock> lock(m_mutex);
+    if (m_closed) return;
+    m_closed = true;
+    if (m_vacuuming)
+    {
+        m_pager.EndVacuum();
+        m_vacuuming = false;
+    }
+    SaveWarmup();
     m_pager.Close();
 }
 
+void BTree::WaitWarmup()
+{
+    if (m_warm_thread.joinable())
+        m_warm_thread.join();
+}
+
+// remember the cached nodes, upper levels first, for the next Open
+void BTree::SaveWarmup()
+{
+    std::vector<int64_t> pages;
+    std::vector<std::shared_ptr<MemPage>> level(1, m_root);
+    int64_t bytes = 0;
+    while (!level.empty() && bytes < m_pager.m_capacity)
+    {
+        std::vector<std::shared_ptr<MemPage>> next;
+        for (size_t i = 0; i < level.size() && bytes < m_pager.m_capacity; ++i)
+        {
+            pages.push_back(level[i]->header.page_no);
+            bytes += level[i]->charge;
+            for (size_t j = 0; j < level[i]->children.size(); ++j)
+            {
+                auto iter = m_pager.m_pages.find(level[i]->children[j]);
+                if (iter != m_pager.m_pages.end())
+                    next.push_back(iter->second);
+            }
+        }
+        level.swap(next);
+    }
+    m_pager.SaveWarmList(pages);
+}
+
+// load the pages of the warm list with few large reads, outside the
+// lock. A run read while some page left the cache may hold an image
+// that was overwritten since, it is dropped as a whole
+void BTree::WarmupLoop(std::vector<int64_t> pages)
+{
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    std::string buf;
+    size_t i = 0;
+    while (i < pages.size())
+    {
+        size_t j = i + 1;
+        while (j < pages.size() && pages[j] - pages[j - 1] <= BT_WARM_GAP &&
+                pages[j] - pages[i] < BT_WARM_RUN)
+            ++j;
+        int64_t first = pages[i];
+        int64_t seq;
+        {
+            std::lock_guard<RWLock> lock(m_mutex);
+            if (m_warm_stop) return;
+            seq = m_pager.m_evict_seq;
+        }
+
+        int64_t got = m_pager.WarmRead(first, pages[j - 1] - first + 1, buf);
+        std::vector<std::shared_ptr<MemPage>> mps;
+        for (size_t k = i; k < j && pages[k] - first < got; ++k)
+        {
+            int64_t off = pages[k] - first;
+            auto mp = m_pager.WarmPage(&buf[off * PG_SIZE], pages[k], got - off);
+            if (mp) mps.push_back(mp);
+        }
+
+        std::lock_guard<RWLock> lock(m_mutex);
+        if (m_warm_stop) return;
+        if (seq == m_pager.m_evict_seq)
+        {
+            for (size_t k = 0; k < mps.size(); ++k)
+            {
+                if (!m_pager.InstallPage(mps[k]) &&
+                        m_pager.m_usage >= m_pager.m_capacity)
+                    return;
+            }
+        }
+        i = j;
+    }
+}
+
+void BTree::StopFlusher()
+{
+    {
+        std::lock_guard<RWLock> lock(m_mutex);
+        m_flush_stop = true;
+    }
+    m_flush_cond.notify_all();
+    if (m_flush_thread.joinable())
+        m_flush_thread.join();
+}
+
+int64_t BTree::DirtyTarget()
+{
+    return (int64_t)(m_dirty_ratio * m_pager.m_pages.size());
+}
+
+// write the coldest dirty nodes back ahead of eviction until at most
+// DirtyTarget stay dirty, so a writer's Prune mostly drops clean pages,
+// and checkpoint every m_checkpoint_ms if anything changed. Nodes are
+// encoded under the lock, a batch at a time, and written after
+// releasing it. The write mutex is taken first, so whoever gets the
+// lock next and reads the disk waits for those writes
+void BTree::FlushLoop()
+{
+    typedef std::chrono::steady_clock Clock;
+    int wait_ms = BT_FLUSH_INTERVAL_MS;
+    if (m_checkpoint_ms > 0)
+        wait_ms = std::min(wait_ms, m_checkpoint_ms);
+    Clock::time_point checkpoint = Clock::now();
+    std::unique_lock<RWLock> lock(m_mutex);
+    while (!m_flush_stop)
+    {
+        if (m_checkpoint_ms > 0 &&
+                Clock::now() - checkpoint >= std::chrono::milliseconds(m_checkpoint_ms))
+        {
+            if (m_pager.m_changed)
+                m_pager.Checkpoint();
+            checkpoint = Clock::now();
+        }
+
+        std::vector<std::shared_ptr<MemPage>> held;
+        std::vector<PageRun> runs;
+        std::vector<WriteCall> calls;
+        int64_t cnt = 0;
+        if (m_dirty_ratio < 1)
+            cnt = m_pager.CollectDirty(DirtyTarget(), BT_FLUSH_BATCH, held, runs);
+        if (cnt == 0)
+        {
+            m_flush_cond.wait_for(lock, std::chrono::milliseconds(wait_ms));
+            continue;
+        }
+        m_pager.PlanWrites(runs, calls);
+        m_pager.m_stats.Add(FLUSHER_NODES, cnt);
+        {
+            std::lock_guard<std::mutex> writing(m_pager.m_write_mutex);
+            lock.unlock();
+            m_pager.IssueWrites(calls);
+        }
+        held.clear();
+        // let a writer woken by the unlock in before the next batch
+        std::this_thread::yield();
+        lock.lock();
+    }
+}
+
 Iterator * BTree::NewIterator()
 {
     Iterator *iter = new Iterator(this);
     return iter;
 }
 
+BTree::OpScope::OpScope(BTree *bt, bool write): m_bt(bt), m_write(write)
+{
+    if (write)
+        m_bt->m_write_seq++;
+}
+
+BTree::OpScope::~OpScope()
+{
+    // readers share the tree, only a writer may write pages back. A
+    // write that changed nothing needs no checkpoint
+    if (m_write && m_bt->m_pager.m_sync_mode == SYNC_BATCH && m_bt->m_pager.m_changed)
+        m_bt->m_pager.Checkpoint();
+    m_bt->m_pager.Prune(m_bt->m_pager.m_capacity, false, m_write);
+    // a timed checkpoint is early if the space it frees runs short
+    if (m_write && m_bt->m_checkpoint_ms > 0 && m_bt->m_pager.CheckpointDue())
+        m_bt->m_pager.Checkpoint();
+    if (m_write && m_bt->m_dirty_ratio < 1 &&
+            m_bt->m_pager.m_dirty_pages > m_bt->DirtyTarget())
+        m_bt->m_flush_cond.notify_one();
+}
+
 std::shared_ptr<MemPage> BTree::ReadPage(int64_t page_no)
 {
-    auto mp = m_pager.GetPage(page_no, true);
+    PERF_COUNTER_ADD(pages_visited, 1);
+    auto mp = m_pager.GetPage(page_no);
     assert(mp != nil);
     return mp;
 }
 
-bool BTree::Less(std::string &a, std::string &b)
+// a comparator takes strings, both sides are copied into per-thread
+// ones that keep their capacity
+static thread_local std::string t_cmp_a, t_cmp_b;
+
+inline bool BTree::Less(const Slice &a, const Slice &b)
+{
+    PERF_COUNTER_ADD(key_comparisons, 1);
+    if (m_bytewise) return DefaultCmp::Compare(a, b) < 0;
+    t_cmp_a.assign(a.data, a.size);
+    t_cmp_b.assign(b.data, b.size);
+    return m_cmp_func(t_cmp_a, t_cmp_b);
+}
+
+inline bool BTree::Equal(const Slice &a, const Slice &b)
 {
-    return m_cmp_func(a, b);
+    if (m_bytewise)
+    {
+        PERF_COUNTER_ADD(key_comparisons, 1);
+        return a == b;
+    }
+    PERF_COUNTER_ADD(key_comparisons, 2);
+    t_cmp_a.assign(a.data, a.size);
+    t_cmp_b.assign(b.data, b.size);
+    return !m_cmp_func(t_cmp_a, t_cmp_b) && !m_cmp_func(t_cmp_b, t_cmp_a);
 }
 
-bool BTree::Equal(const std::string &a, const std::string &b)
+// index of the first of n packed keys not less than key (or, upper,
+// greater than key); the loop has no data dependent branch
+static inline size_t PackedBound(const uint64_t *keys, size_t n, uint64_t key, bool upper)
 {
-    return !m_cmp_func(a, b) && !m_cmp_func(b, a);
+    if (n == 0) return 0;
+    const uint64_t *base = keys;
+    int probes = 1;
+    while (n > 1)
+    {
+        size_t half = n / 2;
+        bool right = upper ? base[half] <= key : base[half] < key;
+        base += right ? half : 0;
+        n -= half;
+        probes++;
+    }
+    PERF_COUNTER_ADD(key_comparisons, probes);
+    return (base - keys) + (upper ? *base <= key : *base < key);
 }
 
-KVIter BTree::LowerBound(std::shared_ptr<MemPage> mp, const std::string &key)
+// index of the first kv not less than key, binary search
+size_t BTree::LowerBound(const std::shared_ptr<MemPage> &mp, const std::string &key)
 {
-    for (auto iter = mp->kvs.begin(); iter != mp->kvs.end(); ++iter)
+    if (m_u64_keys && key.length() == 8)
+        return PackedBound(mp->ikeys.data(), mp->ikeys.size(), DecodeU64Key(key), false);
+    const KVArray &kvs = mp->kvs;
+    size_t first = 0;
+    size_t len = kvs.size();
+    while (len > 0)
     {
-        if (!m_cmp_func(iter->key, key))
-            return iter;
+        size_t half = len / 2;
+        if (Less(kvs.Key(first + half), key))
+        {
+            first += half + 1;
+            len -= half + 1;
+        }
+        else
+            len = half;
     }
-    return mp->kvs.end();
+    return first;
 }
 
-KVIter BTree::UpperBound(std::shared_ptr<MemPage> mp, const std::string &key)
+// index of the first kv greater than key
+size_t BTree::UpperBound(const std::shared_ptr<MemPage> &mp, const std::string &key)
 {
-    for (auto iter = mp->kvs.begin(); iter != mp->kvs.end(); ++iter)
+    if (m_u64_keys && key.length() == 8)
+        return PackedBound(mp->ikeys.data(), mp->ikeys.size(), DecodeU64Key(key), true);
+    const KVArray &kvs = mp->kvs;
+    size_t first = 0;
+    size_t len = kvs.size();
+    while (len > 0)
     {
-        if (m_cmp_func(key, iter->key))
-            return iter;
+        size_t half = len / 2;
+        if (!Less(key, kvs.Key(first + half)))
+        {
+            first += half + 1;
+            len -= half + 1;
+        }
+        else
+            len = half;
     }
-    return mp->kvs.end();
+    return first;
 }
 
 int BTree::Get(const char *k, std::string &data)
@@ -87,60 +380,155 @@ int BTree::Del(const char *k)
 
 int BTree::Get(const std::string &key, std::string &data)
 {
+    ReadGuard lock(m_mutex);
+    OpScope op(this, false);
     auto now = m_root;
     while (now != NULL)
     {
-        auto iter = LowerBound(now, key);
-        size_t p = iter - now->kvs.begin();
-        if (iter != now->kvs.end() && Equal(iter->key, key))
+        size_t p = LowerBound(now, key);
+        if (p < now->kvs.size() && Equal(now->kvs.Key(p), key))
         {
-            data = iter->value;
+            Slice value = now->kvs.Value(p);
+            data.assign(value.data, value.size);
             return BT_OK;
         }
         else if (!now->is_leaf)
             now = ReadPage(now->children[p]);
         else
-            return BT_NOT_FOUND;
+            return m_pager.m_corrupt ? BT_CORRUPTION : BT_NOT_FOUND;
     }
     return BT_ERROR;
 }
 
 int BTree::Put(const std::string &key, std::string &data)
 {
-    Insert(m_root, nil, 0, key, data);
+    WriteReq req(WRITE_PUT);
+    return Write(key, data, req);
+}
+
+int BTree::Merge(const std::string &key, const std::string &operand)
+{
+    if (!m_merge_op) return BT_ERROR;
+    WriteReq req(WRITE_MERGE);
+    return Write(key, operand, req);
+}
+
+int BTree::PutIfAbsent(const std::string &key, const std::string &data, std::string *current)
+{
+    WriteReq req(WRITE_IF_ABSENT);
+    req.old = current;
+    int ret = Write(key, data, req);
+    if (ret != BT_OK) return ret;
+    return req.written ? BT_OK : BT_CONFLICT;
+}
+
+int BTree::CompareAndSwap(const std::string &key, const std::string &expected,
+        const std::string &data, std::string *current)
+{
+    WriteReq req(WRITE_IF_EQUAL);
+    req.expected = &expected;
+    req.old = current;
+    int ret = Write(key, data, req);
+    if (ret != BT_OK) return ret;
+    if (!req.found) return BT_NOT_FOUND;
+    return req.written ? BT_OK : BT_CONFLICT;
+}
+
+int BTree::GetAndSet(const std::string &key, const std::string &data, std::string &old)
+{
+    WriteReq req(WRITE_PUT);
+    req.old = &old;
+    int ret = Write(key, data, req);
+    if (ret != BT_OK) return ret;
+    return req.found ? BT_OK : BT_NOT_FOUND;
+}
+
+int BTree::Write(const std::string &key, const std::string &data, WriteReq &req)
+{
+    std::lock_guard<RWLock> lock(m_mutex);
+    OpScope op(this, true);
+    // writing on top of a damaged tree would spread the damage
+    if (m_pager.m_corrupt) return BT_CORRUPTION;
+    if (m_u64_keys && key.length() != 8) return BT_ERROR;
+    Insert(m_root, nil, 0, key, data, req);
     return BT_OK;
 }
 
-void BTree::Insert(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent,
-        int upper_idx, const std::string &key, const std::string &data)
+// req.mode decides what happens where the key lands: data is stored,
+// folded in as a merge operand, or stored only if the condition holds
+bool BTree::Insert(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent,
+        int upper_idx, const std::string &key, const std::string &data, WriteReq &req)
 {
-    auto iter = LowerBound(now, key);
-    size_t p = iter - now->kvs.begin();
-    if (iter != now->kvs.end() && Equal(iter->key, key))
-        iter->value = data;
+    bool inserted = false;
+    size_t p = LowerBound(now, key);
+    req.append = req.append && p == now->kvs.size();
+    if (p < now->kvs.size() && Equal(now->kvs.Key(p), key))
+    {
+        // old may be the same string as data or expected, it is set last
+        req.found = true;
+        req.written = req.mode == WRITE_PUT || req.mode == WRITE_MERGE ||
+            (req.mode == WRITE_IF_EQUAL && now->kvs.Value(p) == *req.expected);
+        std::string prev;
+        if (req.old || (req.written && req.mode == WRITE_MERGE))
+            prev = now->kvs.Value(p).ToString();
+        if (req.written && req.mode == WRITE_MERGE)
+        {
+            std::string result;
+            m_merge_op(key, &prev, data, result);
+            now->SetValue(p, result);
+        }
+        else if (req.written)
+            now->SetValue(p, data);
+        if (req.old) req.old->swap(prev);
+    }
     else if (!now->is_leaf)
     {
         assert(now);
         assert(now->children.size() > p);
-        Insert(ReadPage(now->children[p]), now, p, key, data);
+        inserted = Insert(ReadPage(now->children[p]), now, p, key, data, req);
     }
-    else
-        now->kvs.insert(iter, KV(key, data));
-    if ((int)now->kvs.size() <= 2 * m_min_key_num) return;
+    else if (req.mode == WRITE_MERGE)
+    {
+        std::string result;
+        m_merge_op(key, NULL, data, result);
+        now->InsertKV(p, key, result);
+        inserted = req.written = true;
+    }
+    else if (req.mode != WRITE_IF_EQUAL)
+    {
+        now->InsertKV(p, key, data);
+        inserted = req.written = true;
+    }
+    // every node down to the key changed, the count of its child at least
+    if (req.written)
+        m_pager.MarkDirty(now);
+    if (inserted && parent)
+        parent->counts[upper_idx]++;
+    if ((int)now->kvs.size() <= 2 * m_min_key_num) return inserted;
 
-    //split full
+    //split full, now keeps the left half. Keys appended past the end of
+    //the tree keep landing in its rightmost nodes, there now keeps all
+    //but the last two and the right node starts with one
+    m_pager.m_stats.Add(NODE_SPLITS);
     size_t mid = now->kvs.size() / 2;
-    auto left = m_pager.NewPage();
+    if (req.append)
+    {
+        m_pager.m_stats.Add(NODE_APPEND_SPLITS);
+        mid = now->kvs.size() - 2;
+    }
     auto right = m_pager.NewPage();
 
-    left->is_leaf = right->is_leaf = now->is_leaf;
-    left->kvs.assign(now->kvs.begin(), now->kvs.begin() + mid);
-    right->kvs.assign(now->kvs.begin() + mid + 1, now->kvs.end());
+    right->is_leaf = now->is_leaf;
+    right->InsertKVs(0, *now, mid + 1, now->kvs.size());
     if (!now->is_leaf)
     {
-        left->children.assign(now->children.begin(), now->children.begin() + mid + 1);
         right->children.assign(now->children.begin() + mid + 1, now->children.end());
+        right->counts.assign(now->counts.begin() + mid + 1, now->counts.end());
+        now->children.erase(now->children.begin() + mid + 1, now->children.end());
+        now->counts.erase(now->counts.begin() + mid + 1, now->counts.end());
     }
+    KV sep = now->kvs.Get(mid);
+    now->EraseKVs(mid, now->kvs.size());
 
     if (!parent)
     {
@@ -150,26 +538,33 @@ void BTree::Insert(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent
         m_pager.SetRoot(m_root->header.page_no);
         assert(upper_idx == 0);
         parent->children.resize(upper_idx + 1);
+        parent->counts.resize(upper_idx + 1);
+        m_height++;
     }
     assert(upper_idx < (int)parent->children.size());
-    parent->kvs.insert(parent->kvs.begin() + upper_idx, now->kvs[mid]);
-    parent->children[upper_idx] = left->header.page_no;
+    parent->InsertKV(upper_idx, sep);
+    parent->children[upper_idx] = now->header.page_no;
     parent->children.insert(parent->children.begin() + upper_idx + 1, right->header.page_no);
+    parent->counts[upper_idx] = SubtreeCount(now);
+    parent->counts.insert(parent->counts.begin() + upper_idx + 1, SubtreeCount(right));
+    return inserted;
 }
 
 int BTree::Del(const std::string &key)
 {
+    std::lock_guard<RWLock> lock(m_mutex);
+    OpScope op(this, true);
+    if (m_pager.m_corrupt) return BT_CORRUPTION;
     return Delete(m_root, nil, -1, key);
 }
 
 int BTree::Delete(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent,
         int child_idx, const std::string &key)
 {
-    auto iter = LowerBound(now, key);
-    size_t p = iter - now->kvs.begin();
+    size_t p = LowerBound(now, key);
 
     int del_ret = BT_NOT_FOUND;
-    if (iter != now->kvs.end() && Equal(iter->key, key))
+    if (p < now->kvs.size() && Equal(now->kvs.Key(p), key))
     {
         if (!now->is_leaf)
         {
@@ -178,24 +573,27 @@ int BTree::Delete(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent,
             while (!nd->is_leaf)
                 nd = ReadPage(nd->children.back());
 
-            now->kvs[p] = nd->kvs.back();
-            Delete(left, now, p, nd->kvs.back().key);
+            size_t last = nd->kvs.size() - 1;
+            std::string pred = nd->kvs.Key(last).ToString();
+            now->SetKV(p, nd->kvs.Key(last), nd->kvs.Value(last));
+            Delete(left, now, p, pred);
         }
         else
-            now->kvs.erase(iter);
+            now->EraseKVs(p, p + 1);
         del_ret = BT_OK;
     }
     else if (!now->is_leaf)
         del_ret = Delete(ReadPage(now->children[p]), now, p, key);
 
+    if (del_ret != BT_OK) return del_ret;
+    m_pager.MarkDirty(now);
+    if (parent)
+        parent->counts[child_idx]--;
+
     // maintain now
     if (now == m_root)
-    {
-        if (now->is_leaf || now->kvs.size() > 0) return del_ret;
-        assert(now->children.size() == 1);
-        m_root = ReadPage(now->children[0]);
-    }
-    else if ((int)now->kvs.size() < m_min_key_num)
+        ShrinkRoot();
+    else if ((int)now->kvs.size() < m_merge_key_num)
         Maintain(now, parent, child_idx);
 
     return del_ret;
@@ -207,64 +605,762 @@ void BTree::Maintain(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> pare
     size_t right_sep = (child_idx < (int)parent->children.size() - 1) ? child_idx : -1;
     auto left = (child_idx > 0) ? ReadPage(parent->children[child_idx - 1]) : nil;
     auto right = (child_idx < (int)parent->children.size() - 1) ? ReadPage(parent->children[child_idx + 1]) : nil;
+    m_pager.MarkDirty(now);
+    m_pager.MarkDirty(parent);
 
     // 1.
     if (left && (int)left->kvs.size() > m_min_key_num)
     {
-        now->kvs.insert(now->kvs.begin(), parent->kvs[left_sep]);
+        m_pager.m_stats.Add(NODE_ROTATIONS);
+        m_pager.MarkDirty(left);
+        now->InsertKV(0, parent->kvs.Key(left_sep), parent->kvs.Value(left_sep));
         if (!left->is_leaf)
         {
             now->children.insert(now->children.begin(), left->children.back());
             left->children.pop_back();
+            now->counts.insert(now->counts.begin(), left->counts.back());
+            left->counts.pop_back();
         }
-        parent->kvs[left_sep] = left->kvs.back();
-        left->kvs.pop_back();
+        size_t last = left->kvs.size() - 1;
+        parent->SetKV(left_sep, left->kvs.Key(last), left->kvs.Value(last));
+        left->EraseKVs(left->kvs.size() - 1, left->kvs.size());
+        parent->counts[child_idx - 1] = SubtreeCount(left);
+        parent->counts[child_idx] = SubtreeCount(now);
         return;
     }
     // 2.
     if (right && (int)right->kvs.size() > m_min_key_num)
     {
-        now->kvs.push_back(parent->kvs[right_sep]);
+        m_pager.m_stats.Add(NODE_ROTATIONS);
+        m_pager.MarkDirty(right);
+        now->InsertKV(now->kvs.size(), parent->kvs.Key(right_sep), parent->kvs.Value(right_sep));
         if (!right->is_leaf)
         {
             now->children.push_back(right->children.front());
             right->children.erase(right->children.begin());
+            now->counts.push_back(right->counts.front());
+            right->counts.erase(right->counts.begin());
         }
-        parent->kvs[right_sep] = right->kvs.front();
-        right->kvs.erase(right->kvs.begin());
+        parent->SetKV(right_sep, right->kvs.Key(0), right->kvs.Value(0));
+        right->EraseKVs(0, 1);
+        parent->counts[child_idx] = SubtreeCount(now);
+        parent->counts[child_idx + 1] = SubtreeCount(right);
         return;
     }
+    // 3. merge with a sibling
+    m_pager.m_stats.Add(NODE_MERGES);
     // 3a.
     if (left)
     {
-        left->kvs.push_back(parent->kvs[left_sep]);
-        left->kvs.insert(left->kvs.end(), now->kvs.begin(), now->kvs.end());
+        m_pager.MarkDirty(left);
+        left->InsertKV(left->kvs.size(), parent->kvs.Key(left_sep), parent->kvs.Value(left_sep));
+        left->InsertKVs(left->kvs.size(), *now, 0, now->kvs.size());
         left->children.insert(left->children.end(), now->children.begin(), now->children.end());
+        left->counts.insert(left->counts.end(), now->counts.begin(), now->counts.end());
 
-        parent->kvs.erase(parent->kvs.begin() + left_sep);
+        parent->EraseKVs(left_sep, left_sep + 1);
         parent->children.erase(parent->children.begin() + left_sep + 1);
+        parent->counts.erase(parent->counts.begin() + left_sep + 1);
+        parent->counts[left_sep] = SubtreeCount(left);
+        m_pager.FreePage(now);
     }
     // 3b.
     else if (right)
     {
-        now->kvs.push_back(parent->kvs[right_sep]);
-        now->kvs.insert(now->kvs.end(), right->kvs.begin(), right->kvs.end());
+        now->InsertKV(now->kvs.size(), parent->kvs.Key(right_sep), parent->kvs.Value(right_sep));
+        now->InsertKVs(now->kvs.size(), *right, 0, right->kvs.size());
         now->children.insert(now->children.end(), right->children.begin(), right->children.end());
+        now->counts.insert(now->counts.end(), right->counts.begin(), right->counts.end());
 
-        parent->kvs.erase(parent->kvs.begin() + right_sep);
+        parent->EraseKVs(right_sep, right_sep + 1);
         parent->children.erase(parent->children.begin() + right_sep + 1);
+        parent->counts.erase(parent->counts.begin() + right_sep + 1);
+        parent->counts[child_idx] = SubtreeCount(now);
+        m_pager.FreePage(right);
     }
     else
         assert(false);
 }
 
+void BTree::ShrinkRoot()
+{
+    while (!m_root->is_leaf && m_root->kvs.size() == 0)
+    {
+        assert(m_root->children.size() == 1);
+        auto old_root = m_root;
+        m_root = ReadPage(old_root->children[0]);
+        m_pager.SetRoot(m_root->header.page_no);
+        m_pager.FreePage(old_root);
+        m_height--;
+    }
+}
+
+int BTree::DeleteRange(const char *b, const char *e)
+{
+    std::string begin = b;
+    std::string end = e;
+    return DeleteRange(begin, end);
+}
+
+// delete keys in [begin, end)
+int BTree::DeleteRange(const std::string &begin, const std::string &end)
+{
+    std::lock_guard<RWLock> lock(m_mutex);
+    OpScope op(this, true);
+    if (m_pager.m_corrupt) return BT_CORRUPTION;
+    if (!Less(begin, end)) return BT_OK;
+
+    RemoveRange(m_root, begin, end);
+    ShrinkRoot();
+
+    // RemoveRange keeps one in-range separator per split boundary
+    // node, at most two per level; drop them one by one
+    std::string key;
+    while (FirstAtLeast(begin, key) && Less(key, end))
+        Delete(m_root, nil, -1, key);
+    return BT_OK;
+}
+
+bool BTree::FirstAtLeast(const std::string &key, std::string &found)
+{
+    bool ok = false;
+    auto now = m_root;
+    while (true)
+    {
+        size_t p = LowerBound(now, key);
+        if (p < now->kvs.size())
+        {
+            Slice k = now->kvs.Key(p);
+            found.assign(k.data, k.size);
+            ok = true;
+            if (Equal(k, key)) break;
+        }
+        if (now->is_leaf) break;
+        now = ReadPage(now->children[p]);
+    }
+    return ok;
+}
+
+// false if the subtree has no key in the range and stays as it is
+bool BTree::RemoveRange(std::shared_ptr<MemPage> now, const std::string &begin, const std::string &end)
+{
+    size_t lo = LowerBound(now, begin);
+    size_t hi = LowerBound(now, end);
+    if (now->is_leaf)
+    {
+        if (lo == hi) return false;
+        m_pager.MarkDirty(now);
+        now->EraseKVs(lo, hi);
+        return true;
+    }
+    if (lo == hi)
+    {
+        auto child = ReadPage(now->children[lo]);
+        if (!RemoveRange(child, begin, end)) return false;
+        m_pager.MarkDirty(now);
+        now->counts[lo] = SubtreeCount(child);
+        Repair(now, lo);
+        return true;
+    }
+
+    // children lo+1 .. hi-1 lie entirely inside the range
+    m_pager.MarkDirty(now);
+    for (size_t i = lo + 1; i < hi; ++i)
+        FreeTree(now->children[i]);
+    // keep kvs[hi-1] as the separator of the two boundary children
+    now->EraseKVs(lo, hi - 1);
+    now->children.erase(now->children.begin() + lo + 1, now->children.begin() + hi);
+    now->counts.erase(now->counts.begin() + lo + 1, now->counts.begin() + hi);
+
+    auto left = ReadPage(now->children[lo]);
+    auto right = ReadPage(now->children[lo + 1]);
+    RemoveRange(right, begin, end);
+    RemoveRange(left, begin, end);
+    now->counts[lo] = SubtreeCount(left);
+    now->counts[lo + 1] = SubtreeCount(right);
+    Repair(now, lo + 1);
+    Repair(now, lo);
+    return true;
+}
+
+// rebalance an underflowed child, which may be far below m_merge_key_num
+void BTree::Repair(std::shared_ptr<MemPage> now, size_t child_idx)
+{
+    while (now->children.size() > 1)
+    {
+        if (child_idx >= now->children.size())
+            child_idx = now->children.size() - 1;
+        auto child = ReadPage(now->children[child_idx]);
+        if ((int)child->kvs.size() >= m_merge_key_num) return;
+
+        size_t child_num = now->children.size();
+        Maintain(child, now, child_idx);
+        // merged into left sibling
+        if (now->children.size() < child_num && child_idx > 0)
+            child_idx--;
+    }
+}
+
+void BTree::FreeTree(int64_t page_no)
+{
+    auto mp = ReadPage(page_no);
+    for (size_t i = 0; i < mp->children.size(); ++i)
+        FreeTree(mp->children[i]);
+    m_pager.FreePage(mp);
+}
+
+int64_t BTree::SubtreeCount(std::shared_ptr<MemPage> mp)
+{
+    int64_t cnt = mp->kvs.size();
+    for (size_t i = 0; i < mp->counts.size(); ++i)
+        cnt += mp->counts[i];
+    return cnt;
+}
+
+int64_t BTree::CountNodes(std::shared_ptr<MemPage> now)
+{
+    int64_t cnt = 1;
+    for (size_t i = 0; i < now->children.size(); ++i)
+        cnt += CountNodes(ReadPage(now->children[i]));
+    return cnt;
+}
+
+int64_t BTree::Count()
+{
+    ReadGuard lock(m_mutex);
+    return SubtreeCount(m_root);
+}
+
+// number of keys in [begin, end)
+int64_t BTree::CountRange(const std::string &begin, const std::string &end)
+{
+    ReadGuard lock(m_mutex);
+    OpScope op(this, false);
+    if (!Less(begin, end)) return 0;
+    return LessCount(end) - LessCount(begin);
+}
+
+int64_t BTree::Rank(const std::string &key)
+{
+    ReadGuard lock(m_mutex);
+    OpScope op(this, false);
+    return LessCount(key);
+}
+
+// number of keys less than key
+int64_t BTree::LessCount(const std::string &key)
+{
+    int64_t rank = 0;
+    auto now = m_root;
+    while (true)
+    {
+        size_t p = LowerBound(now, key);
+        rank += p;
+        if (now->is_leaf)
+            return rank;
+        for (size_t i = 0; i < p; ++i)
+            rank += now->counts[i];
+        if (p < now->kvs.size() && Equal(now->kvs.Key(p), key))
+            return rank + now->counts[p];
+        now = ReadPage(now->children[p]);
+    }
+}
+
+// k-th smallest key, 0 based
+int BTree::Select(int64_t k, std::string &key, std::string &data)
+{
+    ReadGuard lock(m_mutex);
+    OpScope op(this, false);
+    if (k < 0) return BT_NOT_FOUND;
+    auto now = m_root;
+    while (!now->is_leaf)
+    {
+        size_t i = 0;
+        for (; i < now->children.size(); ++i)
+        {
+            if (k < now->counts[i]) break;
+            k -= now->counts[i];
+            if (i == now->kvs.size()) continue;
+            if (k == 0)
+            {
+                key = now->kvs.Key(i).ToString();
+                data = now->kvs.Value(i).ToString();
+                return BT_OK;
+            }
+            k--;
+        }
+        if (i == now->children.size()) return BT_NOT_FOUND;
+        now = ReadPage(now->children[i]);
+    }
+    if (k >= (int64_t)now->kvs.size()) return BT_NOT_FOUND;
+    key = now->kvs.Key(k).ToString();
+    data = now->kvs.Value(k).ToString();
+    return BT_OK;
+}
+
+int BTree::ParallelScan(const std::string &begin, const std::string &end,
+        int num_threads, ScanFunc cb)
+{
+    if (!end.empty() && !Less(begin, end)) return BT_OK;
+    num_threads = std::max(num_threads, 1);
+
+    // slice i is [bounds[i], bounds[i + 1])
+    std::vector<std::string> bounds;
+    {
+        ReadGuard lock(m_mutex);
+        OpScope op(this, false);
+        size_t want = num_threads * BT_SCAN_SLICES;
+        std::vector<std::string> splits;
+        ScanSplits(begin, end, want, splits);
+        bounds.push_back(begin);
+        size_t cuts = std::min(splits.size(), want - 1);
+        for (size_t i = 1; i <= cuts; ++i)
+            bounds.push_back(splits[i * splits.size() / (cuts + 1)]);
+        bounds.push_back(end);
+    }
+
+    // each round copies a batch under the read lock, and cb runs
+    // unlocked. The next round seeks past the last key, so splits and
+    // merges in between neither skip nor repeat keys
+    size_t slices = bounds.size() - 1;
+    std::atomic<size_t> next(0);
+    std::atomic<bool> stop(false);
+    auto worker = [&]()
+    {
+        std::vector<KV> batch;
+        size_t i;
+        while (!stop && (i = next++) < slices)
+        {
+            bool bounded = (i + 1 < slices) || !end.empty();
+            std::string from = bounds[i];
+            bool inclusive = true;
+            while (!stop)
+            {
+                batch.clear();
+                {
+                    ReadGuard lock(m_mutex);
+                    OpScope op(this, false);
+                    ScanFrom(m_root, from, inclusive, bounds[i + 1], bounded, batch);
+                }
+                for (size_t j = 0; j < batch.size() && !stop; ++j)
+                {
+                    if (!cb(batch[j].key, batch[j].value))
+                        stop = true;
+                }
+                if (batch.size() < BT_SCAN_BATCH) break;
+                from = batch.back().key;
+                inclusive = false;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_threads && t < (int)slices; ++t)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+    return m_pager.m_corrupt ? BT_CORRUPTION : BT_OK;
+}
+
+// append the keys of the subtree after from (or at it, inclusive) and
+// before hi (if bounded) in order, until the batch is full. False once
+// the batch is full or hi is reached
+bool BTree::ScanFrom(const std::shared_ptr<MemPage> &now, const std::string &from, bool inclusive,
+        const std::string &hi, bool bounded, std::vector<KV> &batch)
+{
+    size_t p = inclusive ? LowerBound(now, from) : UpperBound(now, from);
+    if (!now->is_leaf && ReadPage(now->children[p])->is_leaf)
+    {
+        size_t last = std::min(now->children.size(), p + BT_READAHEAD_MAX);
+        m_pager.Prefetch(std::vector<int64_t>(now->children.begin() + p, now->children.begin() + last));
+    }
+    for (size_t i = p; ; ++i)
+    {
+        if (!now->is_leaf && !ScanFrom(ReadPage(now->children[i]), from, inclusive, hi, bounded, batch))
+            return false;
+        if (i == now->kvs.size()) return true;
+        if (bounded && !Less(now->kvs.Key(i), hi)) return false;
+        batch.push_back(now->kvs.Get(i));
+        if (batch.size() >= BT_SCAN_BATCH) return false;
+    }
+}
+
+// separators inside (begin, end) in key order, from the highest level
+// that has at least want of them, or the leaves
+void BTree::ScanSplits(const std::string &begin, const std::string &end,
+        size_t want, std::vector<std::string> &splits)
+{
+    std::vector<std::shared_ptr<MemPage>> level(1, m_root);
+    while (true)
+    {
+        splits.clear();
+        std::vector<std::shared_ptr<MemPage>> next;
+        for (size_t i = 0; i < level.size(); ++i)
+        {
+            auto &now = level[i];
+            size_t lo = UpperBound(now, begin);
+            size_t hi = end.empty() ? now->kvs.size() : LowerBound(now, end);
+            hi = std::max(lo, hi);
+            for (size_t j = lo; j < hi; ++j)
+                splits.push_back(now->kvs.Key(j).ToString());
+            if (!now->is_leaf)
+            {
+                for (size_t j = lo; j <= hi; ++j)
+                    next.push_back(ReadPage(now->children[j]));
+            }
+        }
+        if (splits.size() >= want || next.empty()) return;
+        level.swap(next);
+    }
+}
+
+// estimate of CountRange that only reads inner nodes
+int64_t BTree::ApproximateSize(const std::string &begin, const std::string &end)
+{
+    ReadGuard lock(m_mutex);
+    OpScope op(this, false);
+    if (!Less(begin, end)) return 0;
+    return ApproximateRank(end) - ApproximateRank(begin);
+}
+
+int64_t BTree::ApproximateRank(const std::string &key)
+{
+    int64_t rank = 0;
+    int depth = 0;
+    auto now = m_root;
+    while (true)
+    {
+        size_t p = LowerBound(now, key);
+        rank += p;
+        if (now->is_leaf)
+            return rank;
+        for (size_t i = 0; i < p; ++i)
+            rank += now->counts[i];
+        if (p < now->kvs.size() && Equal(now->kvs.Key(p), key))
+            return rank + now->counts[p];
+        // assume key sits in the middle of the leaf it falls into
+        if (++depth == m_height - 1)
+            return rank + now->counts[p] / 2;
+        now = ReadPage(now->children[p]);
+    }
+}
+
+int BTree::GetProperty(const std::string &name, int64_t &value)
+{
+    std::lock_guard<RWLock> lock(m_mutex);
+    return IntProperty(name, value);
+}
+
+int BTree::GetProperty(const std::string &name, std::string &value)
+{
+    std::lock_guard<RWLock> lock(m_mutex);
+    int64_t num = 0;
+    if (name == "fishdb.stats")
+    {
+        value = m_pager.m_stats.ToString();
+        const char *props[] = {"fishdb.tree-height", "fishdb.num-entries", "fishdb.num-pages",
+            "fishdb.free-pages", "fishdb.cache-usage", "fishdb.cache-capacity", "fishdb.cache-pages",
+            "fishdb.cache-dirty-pages", "fishdb.file-size"};
+        for (size_t i = 0; i < sizeof(props) / sizeof(props[0]); ++i)
+        {
+            IntProperty(props[i], num);
+            value += std::string(props[i]) + ": " + std::to_string(num) + "\n";
+        }
+        return BT_OK;
+    }
+    if (IntProperty(name, num) != BT_OK) return BT_NOT_FOUND;
+    value = std::to_string(num);
+    return BT_OK;
+}
+
+int BTree::IntProperty(const std::string &name, int64_t &value)
+{
+    if (name == "fishdb.tree-height")
+        value = m_height;
+    else if (name == "fishdb.num-entries")
+        value = SubtreeCount(m_root);
+    else if (name == "fishdb.num-pages")
+        value = m_pager.m_db_header->total_pages;
+    else if (name == "fishdb.free-pages")
+        value = m_pager.m_bitmap.FreeCount();
+    else if (name == "fishdb.cache-usage")
+        value = m_pager.m_usage;
+    else if (name == "fishdb.cache-capacity")
+        value = m_pager.m_capacity;
+    else if (name == "fishdb.cache-pages")
+        value = m_pager.m_pages.size();
+    else if (name == "fishdb.cache-dirty-pages")
+        value = m_pager.m_dirty_pages;
+    else if (name == "fishdb.file-size")
+        value = m_pager.m_file_size;
+    else if (name == "fishdb.num-nodes")
+    {
+        OpScope op(this, false);
+        value = CountNodes(m_root);
+    }
+    else
+    {
+        // any ticker by its name
+        for (int t = 0; t < TICKER_MAX; ++t)
+        {
+            if (name == Statistics::Name((Ticker)t))
+            {
+                value = m_pager.m_stats.Get((Ticker)t);
+                return BT_OK;
+            }
+        }
+        return BT_NOT_FOUND;
+    }
+    return BT_OK;
+}
+
+int BTree::Checkpoint()
+{
+    std::lock_guard<RWLock> lock(m_mutex);
+    return (m_pager.Checkpoint() == 0) ? BT_OK : BT_ERROR;
+}
+
+int BTree::Backup(const std::string &path, bool incremental)
+{
+    {
+        std::lock_guard<RWLock> lock(m_mutex);
+        if (m_pager.m_corrupt) return BT_CORRUPTION;
+        if (m_pager.BeginBackup(path, incremental) != 0) return BT_ERROR;
+    }
+    return (m_pager.CopyBackup() == 0) ? BT_OK : BT_ERROR;
+}
+
+// Vacuum rewrites the nodes in key order (pre-order, parents first) at
+// the front of the file and truncates the rest. Each call moves at most
+// max_nodes nodes and returns BT_INCOMPLETE until the file is compact.
+// Free pages are the ones clear in the bitmap; with no usable bitmap at
+// Open the first call instead frees every page not reachable from the
+// root, walking the whole tree.
+int BTree::Vacuum(int max_nodes)
+{
+    std::lock_guard<RWLock> lock(m_mutex);
+    OpScope op(this, true);
+    return VacuumStep(max_nodes);
+}
+
+void BTree::StartVacuum(int max_nodes, int interval_ms)
+{
+    StopVacuum();
+    m_vacuum_stop = false;
+    m_vacuum_thread = std::thread(&BTree::VacuumLoop, this, max_nodes, interval_ms);
+}
+
+void BTree::StopVacuum()
+{
+    {
+        std::lock_guard<RWLock> lock(m_mutex);
+        m_vacuum_stop = true;
+    }
+    m_vacuum_cond.notify_all();
+    if (m_vacuum_thread.joinable())
+        m_vacuum_thread.join();
+}
+
+void BTree::VacuumLoop(int max_nodes, int interval_ms)
+{
+    std::unique_lock<RWLock> lock(m_mutex);
+    while (!m_vacuum_stop)
+    {
+        int ret;
+        {
+            OpScope op(this, true);
+            ret = VacuumStep(max_nodes);
+        }
+        if (ret != BT_INCOMPLETE) break;
+        m_vacuum_cond.wait_for(lock, std::chrono::milliseconds(interval_ms));
+    }
+}
+
+int BTree::VacuumStep(int max_nodes)
+{
+    if (m_pager.m_corrupt) return BT_CORRUPTION;
+    if (!m_vacuuming)
+    {
+        if (m_pager.m_bitmap_lost)
+        {
+            // the live pages are found from the root instead, in one
+            // walk of the whole tree under the lock
+            std::set<int64_t> live;
+            MarkLive(m_root, live);
+            if (m_pager.m_corrupt) return BT_CORRUPTION;
+            m_pager.BeginVacuum(live);
+        }
+        else
+            m_pager.BeginVacuum();
+        m_vacuuming = true;
+        m_vacuum_has_cursor = false;
+    }
+
+    int work = 0;
+    std::vector<std::shared_ptr<MemPage>> path;
+    std::vector<int> idx;
+    while (work < max_nodes)
+    {
+        if (!VacuumPath(path, idx)) break;
+        int placed = 0;
+        for (size_t i = 0; i < path.size(); ++i)
+            placed += PlaceNode(path[i], (i > 0) ? path[i - 1] : nil, idx[i]);
+        work += std::max(placed, 1);
+
+        auto leaf = path.back();
+        if (leaf->kvs.empty()) break;
+        m_vacuum_cursor = leaf->kvs.Key(leaf->kvs.size() - 1).ToString();
+        m_vacuum_has_cursor = true;
+        if (work >= max_nodes) return BT_INCOMPLETE;
+    }
+
+    m_pager.EndVacuum();
+    m_vacuuming = false;
+    m_vacuum_has_cursor = false;
+    return BT_OK;
+}
+
+// path from the root to the first leaf holding keys after the cursor
+bool BTree::VacuumPath(std::vector<std::shared_ptr<MemPage>> &path, std::vector<int> &idx)
+{
+    path.clear();
+    idx.clear();
+    auto now = m_root;
+    path.push_back(now);
+    idx.push_back(-1);
+    while (!now->is_leaf)
+    {
+        int p = 0;
+        if (m_vacuum_has_cursor)
+            p = UpperBound(now, m_vacuum_cursor);
+        now = ReadPage(now->children[p]);
+        path.push_back(now);
+        idx.push_back(p);
+    }
+    if (!m_vacuum_has_cursor || UpperBound(now, m_vacuum_cursor) != now->kvs.size())
+        return true;
+
+    // leaf already visited, go to the leftmost leaf of the next subtree
+    while (path.size() > 1)
+    {
+        int p = idx.back();
+        path.pop_back();
+        idx.pop_back();
+        auto parent = path.back();
+        if (p + 1 < (int)parent->children.size())
+        {
+            now = ReadPage(parent->children[p + 1]);
+            path.push_back(now);
+            idx.push_back(p + 1);
+            while (!now->is_leaf)
+            {
+                now = ReadPage(now->children[0]);
+                path.push_back(now);
+                idx.push_back(0);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// move a node to the vacuum frontier, pushing other nodes out of the way
+int BTree::PlaceNode(std::shared_ptr<MemPage> mp, std::shared_ptr<MemPage> parent, int child_idx)
+{
+    int64_t to = m_pager.m_vacuum_frontier;
+    if (mp->header.page_no < to) return 0;
+
+    int cnt = m_pager.PageCount(mp);
+    // the journal's pages and those the last checkpoint may still need
+    // stay where they are
+    while (!m_pager.m_pending.IsFree(to, cnt))
+        to++;
+    if (mp->header.page_no < to) return 0;
+    for (int64_t page_no = to; page_no < to + cnt; ++page_no)
+    {
+        int64_t owner = m_pager.PageOwner(page_no);
+        if (owner > 0 && owner != mp->header.page_no)
+            Displace(owner, to + cnt);
+    }
+    m_pager.MovePage(mp, to);
+    assert(mp->header.page_no == to);
+    m_pager.m_vacuum_frontier = to + cnt;
+
+    if (parent)
+    {
+        parent->children[child_idx] = mp->header.page_no;
+        m_pager.MarkDirty(parent);
+    }
+    else
+        m_pager.SetRoot(mp->header.page_no);
+    return 1;
+}
+
+void BTree::Displace(int64_t page_no, int64_t floor)
+{
+    auto mp = ReadPage(page_no);
+    if (mp == m_root)
+    {
+        m_pager.MovePage(mp, floor);
+        m_pager.SetRoot(mp->header.page_no);
+        return;
+    }
+
+    std::shared_ptr<MemPage> parent;
+    int child_idx = 0;
+    if (!FindParent(mp, parent, child_idx))
+    {
+        // not in the tree, drop only this page
+        mp->header.of_page_no = -1;
+        m_pager.FreePage(mp);
+        return;
+    }
+    m_pager.MovePage(mp, floor);
+    parent->children[child_idx] = mp->header.page_no;
+    m_pager.MarkDirty(parent);
+}
+
+bool BTree::FindParent(std::shared_ptr<MemPage> mp, std::shared_ptr<MemPage> &parent, int &child_idx)
+{
+    if (mp->kvs.empty()) return false;
+    std::string key = mp->kvs.Key(0).ToString();
+    auto now = m_root;
+    while (!now->is_leaf)
+    {
+        size_t p = LowerBound(now, key);
+        if (p < now->kvs.size() && Equal(now->kvs.Key(p), key)) return false;
+        if (now->children[p] == mp->header.page_no)
+        {
+            parent = now;
+            child_idx = p;
+            return true;
+        }
+        now = ReadPage(now->children[p]);
+    }
+    return false;
+}
+
+void BTree::MarkLive(std::shared_ptr<MemPage> now, std::set<int64_t> &live)
+{
+    std::vector<int64_t> pages;
+    m_pager.ChainPages(now, pages);
+    live.insert(pages.begin(), pages.end());
+    // only reads, and must not pull the whole tree into the cache. Dirty
+    // nodes stay: writing one back may move its overflow extent off the
+    // pages recorded above
+    for (size_t i = 0; i < now->children.size(); ++i)
+        MarkLive(m_pager.GetPage(now->children[i]), live);
+    m_pager.Prune(m_pager.m_capacity, false, false);
+}
+
 std::string BTree::Keys(MemPage *mp)
 {
     std::ostringstream out;
     out << "[";
     for (size_t i = 0; i < mp->kvs.size(); ++i)
     {
-        out << mp->kvs[i].key << ((i == mp->kvs.size() - 1) ? "" : " ");
+        out << mp->kvs.Key(i).ToString() << ((i == mp->kvs.size() - 1) ? "" : " ");
     }
     out << "]";
 
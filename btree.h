@@ -8,11 +8,16 @@
 #include <functional>
 #include <memory>
 #include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <assert.h>
 #include <sstream>
 #include <inttypes.h>
 #include "pager.h"
 #include "iter.h"
+#include "rwlock.h"
 
 namespace fishdb
 {
@@ -20,34 +25,89 @@ namespace fishdb
 static const int BT_OK = 0;
 static const int BT_ERROR = -1;
 static const int BT_NOT_FOUND = -2;
+static const int BT_CORRUPTION = -3;
+static const int BT_CONFLICT = -4;     // a conditional write's condition did not hold
+static const int BT_INCOMPLETE = 1;
 
 static const int BT_DEFAULT_KEY_NUM = 2;
+static const int BT_VACUUM_STEP = 64;           // nodes moved per vacuum step
+static const int BT_VACUUM_INTERVAL_MS = 10;    // pause between background steps
+static const int BT_WARM_GAP = 8;               // pages read through to join two runs
+static const int BT_WARM_RUN = 256;             // pages per warm-up read
+static const int BT_READAHEAD_MIN = 2;          // children hinted ahead of a new scan
+static const int BT_READAHEAD_MAX = 64;         // window cap for long sequential scans
+static const int BT_SCAN_SLICES = 4;            // ParallelScan slices per thread
+static const size_t BT_SCAN_BATCH = 256;        // entries copied per ParallelScan lock
+static const int BT_FLUSH_BATCH = 32;           // nodes encoded per flusher lock
+static const int BT_FLUSH_INTERVAL_MS = 100;    // flusher wakeup when no writer calls
+static const double BT_DEFAULT_DIRTY_RATIO = 0.25;
+static const int BT_CHECKPOINT_INTERVAL_MS = 1000;
 
 class BTreeIter;
 
+// bytewise order, a key sorts before its extensions. BTree recognizes it
+// and compares inline instead of calling through CmpFunc
 struct DefaultCmp
 {
-    bool operator()(const std::string &a, const std::string &b)
+    static int Compare(const Slice &a, const Slice &b)
     {
-        int min_len = std::min(a.length(), b.length());
-        if (min_len == 0) return false;
-        int result = memcmp(a.data(), b.data(), min_len);
-        if (result != 0) return result < 0;
-        return a.length() < b.length();
+        size_t min_len = std::min(a.size, b.size);
+        int result = memcmp(a.data, b.data, min_len);
+        if (result != 0) return result;
+        return (a.size < b.size) ? -1 : (a.size > b.size);
+    }
+
+    bool operator()(const std::string &a, const std::string &b) const
+    {
+        return Compare(a, b) < 0;
     }
 };
 
 class Iterator;
 
+struct Options
+{
+    std::function<bool(const std::string &, const std::string &)> cmp_func;
+    int min_key_num;
+    int64_t cache_size;     // bytes of parsed nodes kept in memory
+    // KEY_U64: every key is EncodeU64Key(id), cmp_func is not used.
+    // Fixed at creation, opening with another mode fails
+    int key_mode;
+    // share of cached nodes a background thread lets stay dirty, it
+    // writes the coldest back so eviction finds clean ones. 1 turns it off
+    double dirty_ratio;
+    // SyncMode, see pager.h. Changes are checkpointed by a background
+    // thread this often, and sooner when the pages the last checkpoint
+    // still needs reach 1/8 of the file. 0 leaves it to Checkpoint()
+    // and Close, those pages then grow with the changes until then
+    int sync_mode;
+    int checkpoint_interval_ms;
+    // Merge(key, operand) stores merge_op(key, existing, operand, result),
+    // existing is NULL when the key is absent. Unset, Merge fails
+    std::function<void(const std::string &, const std::string *,
+            const std::string &, std::string &)> merge_op;
+
+    Options(): cmp_func(DefaultCmp()), min_key_num(BT_DEFAULT_KEY_NUM),
+        cache_size(DEFAULT_CACHE_SIZE), key_mode(KEY_BYTES),
+        dirty_ratio(BT_DEFAULT_DIRTY_RATIO), sync_mode(SYNC_CHECKPOINT),
+        checkpoint_interval_ms(BT_CHECKPOINT_INTERVAL_MS) {}
+};
+
 class BTree
 {
 public:
     friend class Iterator;
     typedef std::function<bool(const std::string &, const std::string &)> CmpFunc;
+    typedef std::function<bool(const std::string &, const std::string &)> ScanFunc;
+    typedef std::function<void(const std::string &, const std::string *,
+            const std::string &, std::string &)> MergeFunc;
 
+    static BTree * Open(std::string dbfile, const Options &options);
     static BTree * Open(std::string dbfile,
             CmpFunc cmp_func = DefaultCmp(),
             int min_key_num = BT_DEFAULT_KEY_NUM);
+    // closes the tree if Close was not called
+    ~BTree();
     void Close();
 
     int Get(const char *key, std::string &data);
@@ -56,20 +116,132 @@ public:
     int Get(const std::string &key, std::string &data);
     int Put(const std::string &key, std::string &data);
     int Del(const std::string &key);
+    // read-modify-write in one descent, through Options::merge_op
+    int Merge(const std::string &key, const std::string &operand);
+    // conditional writes, each one descent under the write lock. A
+    // non-NULL current receives the value found, if any.
+    // BT_CONFLICT if key is present, nothing written
+    int PutIfAbsent(const std::string &key, const std::string &data,
+            std::string *current = NULL);
+    // BT_NOT_FOUND if key is absent, BT_CONFLICT if its value is not expected
+    int CompareAndSwap(const std::string &key, const std::string &expected,
+            const std::string &data, std::string *current = NULL);
+    // always writes; BT_OK with the value replaced in old, BT_NOT_FOUND
+    // if key was new
+    int GetAndSet(const std::string &key, const std::string &data, std::string &old);
+    int DeleteRange(const char *begin, const char *end);
+    int DeleteRange(const std::string &begin, const std::string &end);
     Iterator *NewIterator();
 
+    int64_t Count();
+    int64_t CountRange(const std::string &begin, const std::string &end);
+    int64_t Rank(const std::string &key);
+    int Select(int64_t k, std::string &key, std::string &data);
+    int64_t ApproximateSize(const std::string &begin, const std::string &end);
+
+    // write dirty nodes, the allocation bitmap and the header, each
+    // fsynced unless the sync mode is SYNC_OFF. After a crash the file
+    // opens as of the last checkpoint, the journal undoes later writes
+    int Checkpoint();
+
+    // copy a point-in-time image of the file to path while reads and
+    // writes go on; the copy is a fishdb file. Incremental rewrites only
+    // the pages changed since the last backup this instance made to the
+    // same path, or copies everything if there was none
+    int Backup(const std::string &path, bool incremental = false);
+
+    // cb(key, value) for every key in [begin, end), an empty end is no
+    // bound. The range is cut at separators of the upper levels and the
+    // slices are scanned in key order by num_threads threads at once, so
+    // cb must be thread-safe; returning false stops the scan. Writes
+    // made meanwhile may or may not be seen
+    int ParallelScan(const std::string &begin, const std::string &end,
+            int num_threads, ScanFunc cb);
+
+    // introspection: "fishdb.stats" for everything as text, or one of
+    // fishdb.tree-height, num-entries, num-pages, free-pages,
+    // cache-usage (bytes), cache-capacity, cache-pages,
+    // cache-dirty-pages, file-size, num-nodes (walks the tree) and
+    // the ticker names in stats.h
+    int GetProperty(const std::string &name, std::string &value);
+    int GetProperty(const std::string &name, int64_t &value);
+
+    int Vacuum(int max_nodes = BT_VACUUM_STEP);
+    void StartVacuum(int max_nodes = BT_VACUUM_STEP, int interval_ms = BT_VACUUM_INTERVAL_MS);
+    void StopVacuum();
+
+    // block until the pages cached at the last Close are loaded again
+    void WaitWarmup();
+
 protected:
+    // one public operation: a writing one dirties every node it reads,
+    // and the cache is pruned back to budget when it ends
+    struct OpScope
+    {
+        OpScope(BTree *bt, bool write);
+        ~OpScope();
+        BTree *m_bt;
+        bool m_write;
+    };
+
+    // what Insert does where the key lands, and what it found there
+    enum WriteMode { WRITE_PUT, WRITE_MERGE, WRITE_IF_ABSENT, WRITE_IF_EQUAL };
+    struct WriteReq
+    {
+        explicit WriteReq(int m): mode(m), expected(NULL), old(NULL),
+            found(false), written(false), append(true) {}
+        int mode;
+        const std::string *expected;    // WRITE_IF_EQUAL
+        std::string *old;               // the value found, if any
+        bool found;
+        bool written;
+        bool append;                    // every step went past the last key
+    };
+
     std::shared_ptr<MemPage> ReadPage(int64_t page_no);
-    bool Less(std::string &a, std::string &b);
-    bool Equal(const std::string &a, const std::string &b);
-    KVIter LowerBound(std::shared_ptr<MemPage> mp, const std::string &key);
-    KVIter UpperBound(std::shared_ptr<MemPage> mp, const std::string &key);
+    bool Less(const Slice &a, const Slice &b);
+    bool Equal(const Slice &a, const Slice &b);
+    size_t LowerBound(const std::shared_ptr<MemPage> &mp, const std::string &key);
+    size_t UpperBound(const std::shared_ptr<MemPage> &mp, const std::string &key);
 
-    void Insert(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent,
-            int upper_idx, const std::string &key, const std::string &data);
+    bool Insert(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent,
+            int upper_idx, const std::string &key, const std::string &data,
+            WriteReq &req);
+    int Write(const std::string &key, const std::string &data, WriteReq &req);
     int Delete(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent,
             int child_idx, const std::string &key);
     void Maintain(std::shared_ptr<MemPage> now, std::shared_ptr<MemPage> parent, int child_idx);
+    void ShrinkRoot();
+
+    bool RemoveRange(std::shared_ptr<MemPage> now, const std::string &begin, const std::string &end);
+    void Repair(std::shared_ptr<MemPage> now, size_t child_idx);
+    void FreeTree(int64_t page_no);
+    int64_t SubtreeCount(std::shared_ptr<MemPage> mp);
+    int64_t CountNodes(std::shared_ptr<MemPage> now);
+    int64_t ApproximateRank(const std::string &key);
+    int64_t LessCount(const std::string &key);
+    bool FirstAtLeast(const std::string &key, std::string &found);
+    bool ScanFrom(const std::shared_ptr<MemPage> &now, const std::string &from, bool inclusive,
+            const std::string &hi, bool bounded, std::vector<KV> &batch);
+    void ScanSplits(const std::string &begin, const std::string &end,
+            size_t want, std::vector<std::string> &splits);
+
+    int IntProperty(const std::string &name, int64_t &value);
+
+    int VacuumStep(int max_nodes);
+    void VacuumLoop(int max_nodes, int interval_ms);
+    bool VacuumPath(std::vector<std::shared_ptr<MemPage>> &path, std::vector<int> &idx);
+    int PlaceNode(std::shared_ptr<MemPage> mp, std::shared_ptr<MemPage> parent, int child_idx);
+    void Displace(int64_t page_no, int64_t floor);
+    bool FindParent(std::shared_ptr<MemPage> mp, std::shared_ptr<MemPage> &parent, int &child_idx);
+    void MarkLive(std::shared_ptr<MemPage> now, std::set<int64_t> &live);
+
+    void WarmupLoop(std::vector<int64_t> pages);
+    void FlushLoop();
+    void StopFlusher();
+    void StopThreads();
+    int64_t DirtyTarget();
+    void SaveWarmup();
 
     std::string Keys(MemPage *mp);
     std::string Childen(MemPage *mp);
@@ -78,8 +250,38 @@ protected:
 private:
     Pager m_pager;
     int m_min_key_num;
+    // nodes are repaired only below this, a quarter full, so a node
+    // just split or merged is not split or merged again by the next op
+    int m_merge_key_num;
+    int m_height;
+    bool m_closed;
     CmpFunc m_cmp_func;
+    MergeFunc m_merge_op;
+    bool m_bytewise;        // m_cmp_func is DefaultCmp
+    bool m_u64_keys;
     std::shared_ptr<MemPage> m_root;
+
+    // writers exclusive; lookups, iterator moves and scans shared
+    RWLock m_mutex;
+    // bumped by every writer; an iterator that sees it moved since its
+    // last step finds its place again from its key
+    uint64_t m_write_seq;
+
+    bool m_vacuuming;
+    bool m_vacuum_has_cursor;
+    std::string m_vacuum_cursor;    // last key of the last visited leaf
+    bool m_vacuum_stop;
+    std::thread m_vacuum_thread;
+    std::condition_variable_any m_vacuum_cond;
+
+    bool m_warm_stop;
+    std::thread m_warm_thread;
+
+    double m_dirty_ratio;
+    int m_checkpoint_ms;
+    bool m_flush_stop;
+    std::thread m_flush_thread;
+    std::condition_variable_any m_flush_cond;
 };
 
 }
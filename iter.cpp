@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include "btree.h"
 #include "iter.h"
 
@@ -9,15 +10,53 @@ Iterator::Iterator(BTree *btree)
     m_btree = btree;
     m_kv_idx = -1;
     m_valid = false;
+    m_seq = 0;
+    m_ra_window = BT_READAHEAD_MIN;
+}
+
+// hint the children after idx (before it going backward) of the node at
+// stack level, once the scan gets within half a window of the last hint
+void Iterator::Readahead(size_t level, int idx, bool forward)
+{
+    auto &nd = m_stack[level];
+    if (nd->is_leaf) return;
+    if (m_ra_page.size() <= level)
+    {
+        m_ra_page.resize(level + 1, -1);
+        m_ra_edge.resize(level + 1, -1);
+    }
+
+    int from = forward ? idx + 1 : idx - 1;
+    if (m_ra_page[level] == nd->header.page_no)
+    {
+        int left = forward ? m_ra_edge[level] - idx : idx - m_ra_edge[level];
+        if (left > m_ra_window / 2) return;
+        m_ra_window = std::min(m_ra_window * 2, BT_READAHEAD_MAX);
+        from = m_ra_edge[level];
+    }
+
+    std::vector<int64_t> pages;
+    int n = nd->children.size();
+    int i = from;
+    for (; i >= 0 && i < n && std::abs(i - from) < m_ra_window; i += forward ? 1 : -1)
+        pages.push_back(nd->children[i]);
+    m_ra_page[level] = nd->header.page_no;
+    m_ra_edge[level] = i;
+    m_btree->m_pager.Prefetch(pages);
 }
 
 void Iterator::SeekToFirst()
 {
+    ReadGuard lock(m_btree->m_mutex);
+    BTree::OpScope op(m_btree, false);
     auto now = m_btree->m_root;
+    m_stack.clear();
     m_stack.push_back(now);
+    m_ra_window = BT_READAHEAD_MIN;
 
     while (!now->is_leaf)
     {
+        Readahead(m_stack.size() - 1, 0, true);
         now = m_btree->ReadPage(now->children[0]);
         m_stack.push_back(now);
     }
@@ -31,16 +70,22 @@ void Iterator::SeekToFirst()
         m_valid = false;
         m_stack.clear();
     }
+    Capture();
     printf("iter stack_size[%zu]\n", m_stack.size());
 }
 
 void Iterator::SeekToLast()
 {
+    ReadGuard lock(m_btree->m_mutex);
+    BTree::OpScope op(m_btree, false);
     auto now = m_btree->m_root;
+    m_stack.clear();
     m_stack.push_back(now);
+    m_ra_window = BT_READAHEAD_MIN;
 
     while (!now->is_leaf)
     {
+        Readahead(m_stack.size() - 1, now->children.size() - 1, false);
         now = m_btree->ReadPage(now->children.back());
         m_stack.push_back(now);
     }
@@ -54,46 +99,129 @@ void Iterator::SeekToLast()
         m_valid = false;
         m_stack.clear();
     }
+    Capture();
 }
 
 void Iterator::Seek(const char *k)
 {
     std::string key = k;
+    Seek(key);
+}
+
+void Iterator::Seek(const std::string &key)
+{
+    ReadGuard lock(m_btree->m_mutex);
+    BTree::OpScope op(m_btree, false);
+    ToKey(key);
+    Capture();
+}
+
+void Iterator::ToKey(const std::string &key)
+{
     auto now = m_btree->m_root;
+    m_stack.clear();
 
-    bool found_upper = false;
-    while (now != NULL)
+    // descend to the leaf where key would be inserted
+    m_stack.push_back(now);
+    m_ra_window = BT_READAHEAD_MIN;
+    while (!now->is_leaf)
     {
+        size_t p = m_btree->LowerBound(now, key);
+        Readahead(m_stack.size() - 1, p, true);
+        now = m_btree->ReadPage(now->children[p]);
         m_stack.push_back(now);
-        auto iter = m_btree->LowerBound(now, key);
-        size_t p = iter - now->kvs.begin();
-        if (iter != now->kvs.end())
+    }
+
+    // first key >= key is in the leaf, or it is the separator of
+    // the lowest ancestor that has one
+    while (m_stack.size() > 0)
+    {
+        auto nd = m_stack.back();
+        size_t p = m_btree->LowerBound(nd, key);
+        if (p < nd->kvs.size())
         {
-            found_upper = true;
             m_kv_idx = p;
-            now = m_btree->ReadPage(now->children[p]);
-        }
-        else if (!now->is_leaf)
-        {
-            now = m_btree->ReadPage(now->children[p]);
+            m_valid = true;
+            return;
         }
-        else
+        m_stack.pop_back();
+    }
+    m_valid = false;
+    m_kv_idx = -1;
+}
+
+void Iterator::SeekForPrev(const char *k)
+{
+    std::string key = k;
+    SeekForPrev(key);
+}
+
+void Iterator::SeekForPrev(const std::string &key)
+{
+    ReadGuard lock(m_btree->m_mutex);
+    BTree::OpScope op(m_btree, false);
+    ToPrevKey(key);
+    Capture();
+}
+
+void Iterator::ToPrevKey(const std::string &key)
+{
+    auto now = m_btree->m_root;
+    m_stack.clear();
+
+    // descend to the leaf right after the last key <= key
+    m_stack.push_back(now);
+    m_ra_window = BT_READAHEAD_MIN;
+    while (!now->is_leaf)
+    {
+        size_t p = m_btree->UpperBound(now, key);
+        Readahead(m_stack.size() - 1, p, false);
+        now = m_btree->ReadPage(now->children[p]);
+        m_stack.push_back(now);
+    }
+
+    // last key <= key is in the leaf, or it is the separator of
+    // the lowest ancestor that has one
+    while (m_stack.size() > 0)
+    {
+        auto nd = m_stack.back();
+        size_t p = m_btree->UpperBound(nd, key);
+        if (p > 0)
         {
-            break;
+            m_kv_idx = p - 1;
+            m_valid = true;
+            return;
         }
+        m_stack.pop_back();
     }
-
-    m_valid = found_upper;
-    if (!m_valid)
-        m_stack.clear();
+    m_valid = false;
+    m_kv_idx = -1;
 }
 
 void Iterator::Next()
 {
+    ReadGuard lock(m_btree->m_mutex);
+    BTree::OpScope op(m_btree, false);
     assert(Valid());
+    if (m_seq != m_btree->m_write_seq)
+    {
+        // a key past m_key found here means m_key was deleted
+        ToKey(m_key);
+        if (m_valid && !(m_stack.back()->kvs.Key(m_kv_idx) == m_key))
+        {
+            Capture();
+            return;
+        }
+    }
+    if (m_valid)
+        Forward();
+    Capture();
+}
 
+void Iterator::Forward()
+{
     auto now = m_stack.back();
-    std::string cur_key = now->kvs[m_kv_idx].key;
+    const std::string &cur_key = m_key;
 
     // 1. we are leaf
     if (now->is_leaf)
@@ -109,10 +237,10 @@ void Iterator::Next()
         while (m_stack.size() > 0)
         {
             auto nd = m_stack.back();
-            auto iter = m_btree->UpperBound(nd, cur_key);
-            if (iter != nd->kvs.end())
+            size_t p = m_btree->UpperBound(nd, cur_key);
+            if (p < nd->kvs.size())
             {
-                m_kv_idx = iter - nd->kvs.begin();
+                m_kv_idx = p;
                 return;
             }
             else
@@ -123,10 +251,12 @@ void Iterator::Next()
     else
     {
         int p = m_kv_idx + 1;
+        Readahead(m_stack.size() - 1, p, true);
         now = m_btree->ReadPage(now->children[p]);
         m_stack.push_back(now);
         while (!now->is_leaf)
         {
+            Readahead(m_stack.size() - 1, 0, true);
             now = m_btree->ReadPage(now->children[0]);
             m_stack.push_back(now);
         }
@@ -140,6 +270,77 @@ void Iterator::Next()
     return;
 }
 
+void Iterator::Prev()
+{
+    ReadGuard lock(m_btree->m_mutex);
+    BTree::OpScope op(m_btree, false);
+    assert(Valid());
+    if (m_seq != m_btree->m_write_seq)
+    {
+        ToPrevKey(m_key);
+        if (m_valid && !(m_stack.back()->kvs.Key(m_kv_idx) == m_key))
+        {
+            Capture();
+            return;
+        }
+    }
+    if (m_valid)
+        Backward();
+    Capture();
+}
+
+void Iterator::Backward()
+{
+    auto now = m_stack.back();
+    const std::string &cur_key = m_key;
+
+    // 1. we are leaf
+    if (now->is_leaf)
+    {
+        // 1.a leaf have more kv
+        if (m_kv_idx > 0)
+        {
+            m_kv_idx--;
+            return;
+        }
+
+        // 1.b no more kv, find first parent which has a smaller kv
+        while (m_stack.size() > 0)
+        {
+            auto nd = m_stack.back();
+            size_t p = m_btree->LowerBound(nd, cur_key);
+            if (p > 0)
+            {
+                m_kv_idx = p - 1;
+                return;
+            }
+            else
+                m_stack.pop_back();
+        }
+    }
+    // 2. we are inner node
+    else
+    {
+        int p = m_kv_idx;
+        Readahead(m_stack.size() - 1, p, false);
+        now = m_btree->ReadPage(now->children[p]);
+        m_stack.push_back(now);
+        while (!now->is_leaf)
+        {
+            Readahead(m_stack.size() - 1, now->children.size() - 1, false);
+            now = m_btree->ReadPage(now->children.back());
+            m_stack.push_back(now);
+        }
+        m_kv_idx = now->kvs.size() - 1;
+        return;
+    }
+
+    // invalid if came here
+    m_valid = false;
+    m_kv_idx = -1;
+    return;
+}
+
 bool Iterator::Valid()
 {
     // if (m_stack.size() == 0) return false;
@@ -147,18 +348,28 @@ bool Iterator::Valid()
     return m_valid;
 }
 
+// copy out the entry at the position while the nodes are known good
+void Iterator::Capture()
+{
+    if (!m_valid) return;
+    auto &node = m_stack.back();
+    Slice key = node->kvs.Key(m_kv_idx);
+    Slice value = node->kvs.Value(m_kv_idx);
+    m_key.assign(key.data, key.size);
+    m_value.assign(value.data, value.size);
+    m_seq = m_btree->m_write_seq;
+}
+
 std::string Iterator::Key()
 {
     assert(Valid());
-    auto &node = m_stack.back();
-    return node->kvs[m_kv_idx].key;
+    return m_key;
 }
 
 std::string Iterator::Value()
 {
     assert(Valid());
-    auto &node = m_stack.back();
-    return node->kvs[m_kv_idx].value;
+    return m_value;
 }
 
 }
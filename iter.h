@@ -2,6 +2,8 @@
 #define CURSOR_H_
 
 #include <vector>
+#include <string>
+#include <stdint.h>
 #include <memory>
 
 namespace fishdb
@@ -18,17 +20,42 @@ public:
     void SeekToFirst();
     void SeekToLast();
     void Seek(const char *k);
+    void SeekForPrev(const char *k);
+    void Seek(const std::string &key);
+    void SeekForPrev(const std::string &key);
     void Next();
+    void Prev();
     bool Valid();
 
     std::string Key();
     std::string Value();
 
 private:
+    void Readahead(size_t level, int idx, bool forward);
+    // the moves, with the tree lock held
+    void ToKey(const std::string &key);
+    void ToPrevKey(const std::string &key);
+    void Forward();
+    void Backward();
+    void Capture();
+
     BTree *m_btree;
     std::vector<std::shared_ptr<MemPage>> m_stack;
     int m_kv_idx;
     bool m_valid;
+
+    // the entry at the position, copied, and the tree's write seq then.
+    // A write may split or shrink the nodes on m_stack, so the next
+    // move first seeks m_key again
+    std::string m_key;
+    std::string m_value;
+    uint64_t m_seq;
+
+    // per stack level, the node last hinted and the first child past
+    // the hinted window; the window doubles while the scan keeps going
+    std::vector<int64_t> m_ra_page;
+    std::vector<int> m_ra_edge;
+    int m_ra_window;
 };
 
 }
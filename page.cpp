@@ -2,6 +2,7 @@
 #include "util.h"
 #include <inttypes.h>
 #include <cmath>
+#include <algorithm>
 
 namespace fishdb
 {
@@ -11,11 +12,212 @@ void MemPage::Clear()
     data.clear();
 }
 
+// heap bytes held by this node
+int64_t MemPage::Footprint()
+{
+    int64_t bytes = sizeof(MemPage) + data.capacity() + kvs.Footprint();
+    bytes += (children.capacity() + counts.capacity()) * sizeof(int64_t);
+    bytes += ikeys.capacity() * sizeof(uint64_t);
+    return bytes;
+}
+
+void MemPage::InsertKV(size_t pos, const Slice &key, const Slice &value)
+{
+    if (U64Keys())
+    {
+        assert(key.size == 8);
+        ikeys.insert(ikeys.begin() + pos, DecodeU64Key(key.data));
+    }
+    kvs.Insert(pos, key, value);
+}
+
+void MemPage::InsertKVs(size_t pos, MemPage &src, size_t first, size_t last)
+{
+    kvs.Insert(pos, src.kvs, first, last);
+    if (U64Keys())
+        ikeys.insert(ikeys.begin() + pos, src.ikeys.begin() + first, src.ikeys.begin() + last);
+}
+
+void MemPage::EraseKVs(size_t first, size_t last)
+{
+    kvs.Erase(first, last);
+    if (U64Keys())
+        ikeys.erase(ikeys.begin() + first, ikeys.begin() + last);
+}
+
+void MemPage::SetKV(size_t pos, const Slice &key, const Slice &value)
+{
+    if (U64Keys())
+    {
+        assert(key.size == 8);
+        ikeys[pos] = DecodeU64Key(key.data);
+    }
+    kvs.Set(pos, key, value);
+}
+
+bool KVArray::Inside(const Slice &s) const
+{
+    return s.data >= m_buf.data() && s.data < m_buf.data() + m_buf.size();
+}
+
+// copy key and value to the end of the buffer, either may lie in it
+KVArray::Slot KVArray::Place(const Slice &key, const Slice &value)
+{
+    if (Inside(key) || Inside(value))
+    {
+        std::string k = key.ToString(), v = value.ToString();
+        return Place(k, v);
+    }
+    Slot slot;
+    slot.key_off = m_buf.size();
+    slot.key_len = key.size;
+    m_buf.append(key.data, key.size);
+    slot.val_off = m_buf.size();
+    slot.val_len = value.size;
+    m_buf.append(value.data, value.size);
+    return slot;
+}
+
+void KVArray::Insert(size_t pos, const Slice &key, const Slice &value)
+{
+    Slot slot = Place(key, value);
+    m_slots.insert(m_slots.begin() + pos, slot);
+}
+
+void KVArray::Insert(size_t pos, const KVArray &src, size_t first, size_t last)
+{
+    assert(&src != this);
+    std::vector<Slot> slots;
+    slots.reserve(last - first);
+    for (size_t i = first; i < last; ++i)
+        slots.push_back(Place(src.Key(i), src.Value(i)));
+    m_slots.insert(m_slots.begin() + pos, slots.begin(), slots.end());
+}
+
+void KVArray::Erase(size_t first, size_t last)
+{
+    for (size_t i = first; i < last; ++i)
+        m_dead += m_slots[i].key_len + m_slots[i].val_len;
+    m_slots.erase(m_slots.begin() + first, m_slots.begin() + last);
+    MaybePack();
+}
+
+void KVArray::Set(size_t pos, const Slice &key, const Slice &value)
+{
+    Slot slot = Place(key, value);
+    m_dead += m_slots[pos].key_len + m_slots[pos].val_len;
+    m_slots[pos] = slot;
+    MaybePack();
+}
+
+// a value no longer than the old one is written over it
+void KVArray::SetValue(size_t pos, const Slice &value)
+{
+    Slot &slot = m_slots[pos];
+    if (value.size <= slot.val_len)
+    {
+        memmove(&m_buf[slot.val_off], value.data, value.size);
+        m_dead += slot.val_len - value.size;
+        slot.val_len = value.size;
+        return;
+    }
+    Slot moved = Place(Key(pos), value);
+    m_dead += m_slots[pos].key_len + m_slots[pos].val_len;
+    m_slots[pos] = moved;
+    MaybePack();
+}
+
+void KVArray::Reserve(size_t n)
+{
+    m_slots.reserve(n);
+}
+
+void KVArray::Locate(size_t key_off, size_t key_len, size_t val_off, size_t val_len)
+{
+    Slot slot;
+    slot.key_off = key_off;
+    slot.key_len = key_len;
+    slot.val_off = val_off;
+    slot.val_len = val_len;
+    m_slots.push_back(slot);
+}
+
+// the image may end in the padding of its last page, which is cut off
+void KVArray::Adopt(std::string &image, size_t used)
+{
+    m_buf.swap(image);
+    m_buf.resize(used);
+    if (m_buf.capacity() - used > used / 8)
+        m_buf.shrink_to_fit();
+    m_dead = m_buf.size();
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        assert(m_slots[i].val_off + m_slots[i].val_len <= m_buf.size());
+        m_dead -= m_slots[i].key_len + m_slots[i].val_len;
+    }
+}
+
+int64_t KVArray::Footprint() const
+{
+    return m_buf.capacity() + m_slots.capacity() * sizeof(Slot);
+}
+
+// drop the bytes of erased and overwritten entries once they are the
+// larger part of the buffer
+void KVArray::MaybePack()
+{
+    if (m_dead * 2 <= m_buf.size()) return;
+    std::string buf;
+    buf.reserve(m_buf.size() - m_dead);
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        Slot &slot = m_slots[i];
+        uint32_t key_off = buf.size();
+        buf.append(m_buf, slot.key_off, slot.key_len);
+        slot.key_off = key_off;
+        uint32_t val_off = buf.size();
+        buf.append(m_buf, slot.val_off, slot.val_len);
+        slot.val_off = val_off;
+    }
+    m_buf.swap(buf);
+    m_dead = 0;
+}
+
+// a tree node knows its image size from the header and stops there.
+// Nodes written without it, or with one past their pages, take whole pages
 void MemPage::Feed(const char *buf, int size)
 {
+    if (header.type == TREE_PAGE && header.data_size > 0 &&
+            header.data_size <= header.page_cnt * PAGE_CAPA)
+    {
+        if (data.empty())
+            data.reserve(header.data_size);
+        size = std::min(size, header.data_size - (int)data.size());
+    }
     data.append(buf, size);
 }
 
+// length prefixed, as EncodeString
+static int EncodeSlice(char *buf, const Slice &s)
+{
+    EncodeInt32(buf, s.size);
+    memcpy(buf + 4, s.data, s.size);
+    return 4 + s.size;
+}
+
+// bytes Serialize writes, values are not bounded by a page
+int MemPage::SerializedSize()
+{
+    int size = sizeof(PageHeader) + 3 * 4;
+    size += (children.size() + counts.size()) * 8;
+    for (size_t i = 0; i < kvs.size(); ++i)
+    {
+        size += (U64Keys() ? 8 : 4 + kvs.Key(i).size) + 4;
+        size += kvs.Value(i).size;
+    }
+    return size;
+}
+
 void MemPage::Serialize(char *buf, int &size)
 {
     char *sp = buf;
@@ -27,40 +229,84 @@ void MemPage::Serialize(char *buf, int &size)
     for (size_t i = 0; i < children.size(); ++i)
         buf += EncodeInt64(buf, children[i]);
 
+    buf += EncodeInt32(buf, counts.size());
+    for (size_t i = 0; i < counts.size(); ++i)
+        buf += EncodeInt64(buf, counts[i]);
+
     buf += EncodeInt32(buf, kvs.size());
+    if (U64Keys())
+    {
+        // the keys as one array, then the values
+        assert(ikeys.size() == kvs.size());
+        for (size_t i = 0; i < ikeys.size(); ++i)
+            buf += EncodeInt64(buf, ikeys[i]);
+        for (size_t i = 0; i < kvs.size(); ++i)
+            buf += EncodeSlice(buf, kvs.Value(i));
+        size = buf - sp;
+        return;
+    }
     for (size_t i = 0; i < kvs.size(); ++i)
     {
-        buf += EncodeString(buf, kvs[i].key);
-        buf += EncodeString(buf, kvs[i].value);
+        buf += EncodeSlice(buf, kvs.Key(i));
+        buf += EncodeSlice(buf, kvs.Value(i));
     }
     size = buf - sp;
 }
 
-char sbuf[PG_SIZE * 1000];
+// the image becomes the buffer of kvs, entries are only located in it
 void MemPage::Parse()
 {
-    char *buf = sbuf;
-    memcpy(sbuf, data.c_str(), data.size());
+    // decodes in place, readers parse different pages at once
+    assert(kvs.empty());
+    char *buf = &data[0];
     is_leaf = header.is_leaf;
     int32_t num;
 
+    // the arrays are stored as EncodeInt64 lays them out, copied whole
     buf += DecodeInt32(buf, num);
-    for (int i = 0; i < num; ++i)
-    {
-        int64_t c;
-        buf += DecodeInt64(buf, c);
-        children.push_back(c);
-    }
+    children.resize(num);
+    if (num > 0)
+        memcpy(&children[0], buf, num * sizeof(int64_t));
+    buf += num * sizeof(int64_t);
 
     buf += DecodeInt32(buf, num);
+    counts.resize(num);
+    if (num > 0)
+        memcpy(&counts[0], buf, num * sizeof(int64_t));
+    buf += num * sizeof(int64_t);
+
+    buf += DecodeInt32(buf, num);
+    kvs.Reserve(num);
+    if (U64Keys())
+    {
+        // the key array is overwritten in place with the key bytes
+        size_t keys_at = buf - &data[0];
+        ikeys.resize(num);
+        if (num > 0)
+            memcpy(&ikeys[0], buf, num * sizeof(uint64_t));
+        for (int i = 0; i < num; ++i, buf += 8)
+            EncodeU64Key(buf, ikeys[i]);
+        for (int i = 0; i < num; ++i)
+        {
+            int32_t len;
+            buf += DecodeInt32(buf, len);
+            kvs.Locate(keys_at + 8 * i, 8, buf - &data[0], len);
+            buf += len;
+        }
+        kvs.Adopt(data, buf - &data[0]);
+        return;
+    }
     for (int i = 0; i < num; ++i)
     {
-        std::string k, v;
-        buf += DecodeString(buf, k);
-        buf += DecodeString(buf, v);
-        kvs.push_back(KV(k, v));
+        int32_t klen, vlen;
+        buf += DecodeInt32(buf, klen);
+        char *key = buf;
+        buf += klen;
+        buf += DecodeInt32(buf, vlen);
+        kvs.Locate(key - &data[0], klen, buf - &data[0], vlen);
+        buf += vlen;
     }
+    kvs.Adopt(data, buf - &data[0]);
 }
 
 }
-
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <cstring>
+#include <stdint.h>
 #include <assert.h>
 
 namespace fishdb
@@ -14,25 +16,58 @@ enum PageType
     TREE_PAGE = 2,
     OF_PAGE = 3,
     FREE_PAGE = 4,
+    JOURNAL_PAGE = 5,
 };
 
+static const uint32_t DB_MAGIC = 0x42444846;    // "FHDB"
+
+// how keys are stored, fixed when the file is created
+enum KeyMode
+{
+    KEY_BYTES = 0,          // any string, length prefixed
+    KEY_U64 = 1,            // 8-byte EncodeU64Key strings, packed as integers
+};
+
+// page 0 holds two header slots, checkpoints alternate between them so
+// a torn header write leaves the previous one intact
+static const int HEADER_SLOTS = 2;
+
 struct DBHeader
 {
-    int64_t free_list;
+    uint32_t magic;
+    uint32_t checksum;      // crc32c of the header with this field zeroed
+    int64_t bitmap_page;    // allocation bitmap, one extent of META_PAGEs
+    int64_t bitmap_pages;
     int64_t root_page;
     int64_t total_pages;
+    int64_t key_mode;
+    int64_t seq;            // checkpoint number, the slot is seq % HEADER_SLOTS
+    int64_t journal_page;   // first journal directory after it, see Pager::SaveJournal
+};
+
+// sidecar listing the pages that were cached at close, see Pager::SaveWarmList
+static const uint32_t WARM_MAGIC = 0x4d524157;  // "WARM"
+
+struct WarmHeader
+{
+    uint32_t magic;
+    uint32_t checksum;      // crc32c of the page numbers
+    int64_t count;
 };
 
 struct PageHeader
 {
     int64_t page_no;
     int8_t type;
+    uint32_t checksum;      // crc32c of the whole page with this field zeroed
     int64_t next_free;
     int64_t of_page_no;
     int32_t data_size;
     int16_t page_cnt;
     int8_t is_leaf;
+    int8_t flags;
 };
+static const int8_t PF_U64_KEYS = 1;   // node keys are a packed uint64 array
 static const int PG_SIZE = 512;
 static const int PH_SIZE = sizeof(PageHeader);
 static const int PAGE_CAPA = PG_SIZE - sizeof(PageHeader);
@@ -44,7 +79,76 @@ struct KV
     KV(const std::string &_key, const std::string &_value):
         key(_key), value(_value) {}
 };
-typedef std::vector<KV>::iterator KVIter;
+
+// bytes owned by someone else, valid until the owner changes
+struct Slice
+{
+    const char *data;
+    size_t size;
+
+    Slice(): data(""), size(0) {}
+    Slice(const char *d, size_t n): data(d), size(n) {}
+    Slice(const char *s): data(s), size(strlen(s)) {}
+    Slice(const std::string &s): data(s.data()), size(s.size()) {}
+    std::string ToString() const { return std::string(data, size); }
+};
+
+inline bool operator==(const Slice &a, const Slice &b)
+{
+    return a.size == b.size && memcmp(a.data, b.data, a.size) == 0;
+}
+
+// the entries of a node in one buffer, found through an array of slots
+// in key order. Inserts and erases shift the 16-byte slots, key and value
+// bytes stay put. Bytes of erased or overwritten entries are left behind
+// until they are the larger part of the buffer, then the live ones are
+// packed. Any change may move the bytes under Slices handed out earlier
+class KVArray
+{
+public:
+    KVArray(): m_dead(0) {}
+
+    size_t size() const { return m_slots.size(); }
+    bool empty() const { return m_slots.empty(); }
+    Slice Key(size_t i) const
+    {
+        return Slice(m_buf.data() + m_slots[i].key_off, m_slots[i].key_len);
+    }
+    Slice Value(size_t i) const
+    {
+        return Slice(m_buf.data() + m_slots[i].val_off, m_slots[i].val_len);
+    }
+    KV Get(size_t i) const { return KV(Key(i).ToString(), Value(i).ToString()); }
+
+    void Insert(size_t pos, const Slice &key, const Slice &value);
+    void Insert(size_t pos, const KVArray &src, size_t first, size_t last);
+    void Erase(size_t first, size_t last);
+    void Set(size_t pos, const Slice &key, const Slice &value);
+    void SetValue(size_t pos, const Slice &value);
+
+    // decoding: a slot for each entry of a node image, in order, then
+    // the image itself is taken over as the buffer
+    void Reserve(size_t n);
+    void Locate(size_t key_off, size_t key_len, size_t val_off, size_t val_len);
+    void Adopt(std::string &image, size_t used);
+    int64_t Footprint() const;
+
+private:
+    struct Slot
+    {
+        uint32_t key_off;
+        uint32_t key_len;
+        uint32_t val_off;
+        uint32_t val_len;
+    };
+    bool Inside(const Slice &s) const;
+    Slot Place(const Slice &key, const Slice &value);
+    void MaybePack();
+
+    std::string m_buf;
+    std::vector<Slot> m_slots;
+    size_t m_dead;          // bytes of m_buf no slot points to
+};
 
 struct Page
 {
@@ -58,15 +162,33 @@ struct MemPage
     std::string data;
 
     std::vector<int64_t> children;
-    std::vector<KV> kvs;
+    std::vector<int64_t> counts;    // number of entries under each child
+    KVArray kvs;
+    std::vector<uint64_t> ikeys;    // the keys again, packed, with PF_U64_KEYS
     bool stick;
     bool is_leaf;
+    bool dirty;             // changed since it was last written
+    bool touched;           // dirtied in this operation, charge is stale
+    int64_t charge;         // bytes accounted to the cache
     MemPage *lru_next;
     MemPage *lru_prev;
 
 public:
     void Clear();
+    int64_t Footprint();
+    bool U64Keys() { return header.flags & PF_U64_KEYS; }
+
+    // every change to kvs goes through these, they keep ikeys in step
+    void InsertKV(size_t pos, const Slice &key, const Slice &value);
+    void InsertKV(size_t pos, const KV &kv) { InsertKV(pos, kv.key, kv.value); }
+    void InsertKVs(size_t pos, MemPage &src, size_t first, size_t last);
+    void EraseKVs(size_t first, size_t last);
+    void SetKV(size_t pos, const Slice &key, const Slice &value);
+    void SetKV(size_t pos, const KV &kv) { SetKV(pos, kv.key, kv.value); }
+    void SetValue(size_t pos, const Slice &value) { kvs.SetValue(pos, value); }
+
     void Feed(const char *buf, int size);
+    int SerializedSize();
     void Serialize(char *buf, int &size);
     void Parse();
 };
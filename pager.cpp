@@ -1,51 +1,260 @@
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <cstring>
+#include <cstdio>
 #include "pager.h"
 #include <cmath>
+#include <algorithm>
 #include <inttypes.h>
 
 namespace fishdb
 {
 
-int Pager::Init(std::string file)
+int Pager::Init(std::string file, int64_t cache_size, int key_mode, int sync_mode)
 {
     m_db_header = new DBHeader();
+    m_sync_mode = sync_mode;
+    m_changed = false;
+    m_backup = NULL;
+    m_backup_seq = 0;
+    m_vacuum = false;
+    m_vacuum_frontier = 1;
+    m_alloc_floor = 1;
+    m_bitmap_lost = false;
+    m_journal_next = -1;
+    m_corrupt = 0;
+    m_lru_head = NULL;
+    m_lru_tail = NULL;
+    m_usage = 0;
+    m_capacity = cache_size;
+    m_dirty_pages = 0;
+    m_evict_seq = 0;
+    m_path = file;
 
-    m_file = fopen(file.c_str(), "rb+");
-    if (m_file == NULL)
-        m_file = fopen(file.c_str(), "wb+");
-    assert(m_file);
-    fseek(m_file, 0L, SEEK_END);
-    m_file_size = ftell(m_file);
-    fseek(m_file, 0, SEEK_SET);
+    m_fd = open(file.c_str(), O_RDWR | O_CREAT, 0644);
+    assert(m_fd >= 0);
+    struct stat st;
+    fstat(m_fd, &st);
+    m_file_size = st.st_size;
 
     if (m_file_size < PG_SIZE)
     {
         memset(m_db_header, 0, sizeof(DBHeader));
-        m_db_header->free_list = -1;
+        m_db_header->magic = DB_MAGIC;
+        m_db_header->bitmap_page = -1;
+        m_db_header->bitmap_pages = 0;
         m_db_header->root_page = -1;
         m_db_header->total_pages = 1;
-        ftruncate(fileno(m_file), PG_SIZE);
+        m_db_header->journal_page = -1;
+        m_db_header->key_mode = key_mode;
+        ftruncate(m_fd, PG_SIZE);
         m_file_size = PG_SIZE;
-        fseek(m_file, 0, SEEK_SET);
-        fwrite((char *)m_db_header, sizeof(DBHeader), 1, m_file);
+        WriteHeader();
     }
     else
     {
-        // TODO do some check
-        fread((void *)m_db_header, sizeof(DBHeader), 1, m_file);
+        // the newest intact slot is the last checkpoint
+        DBHeader slots[HEADER_SLOTS];
+        int newest = -1;
+        for (int i = 0; i < HEADER_SLOTS; ++i)
+        {
+            if (ReadHeader(m_fd, i, slots[i]) && (newest < 0 || slots[i].seq > slots[newest].seq))
+                newest = i;
+        }
+        if (newest < 0)
+        {
+            fprintf(stderr, "fishdb: %s is not a fishdb file or its header is corrupt\n",
+                    file.c_str());
+            close(m_fd);
+            delete m_db_header;
+            return -1;
+        }
+        *m_db_header = slots[newest];
+        if (m_db_header->key_mode != key_mode)
+        {
+            fprintf(stderr, "fishdb: %s was created with key mode %" PRId64 ", opened with %d\n",
+                    file.c_str(), m_db_header->key_mode, key_mode);
+            close(m_fd);
+            delete m_db_header;
+            return -1;
+        }
+        Recover();
+    }
+    LoadBitmap();
+    m_stable = m_bitmap;
+    m_journaled.Reset(0);
+    m_pending.Reset(0);
+    m_pending_pages = 0;
+    m_journal_next = m_db_header->journal_page;
+    if (m_journal_next > 0)
+    {
+        m_bitmap.Set(m_journal_next);
+        m_pending.Set(m_journal_next);
+        m_pending_pages = 1;
     }
     return 0;
 }
 
 void Pager::Close()
 {
-    fseek(m_file, 0, SEEK_SET);
-    fwrite((char *)m_db_header, sizeof(DBHeader), 1, m_file);
     Prune(0, true);
-    fclose(m_file);
+    Checkpoint();
+    // the journal of a big write-back is free now, often at the end
+    if (m_bitmap.LastUsed() + 1 < m_db_header->total_pages)
+    {
+        Checkpoint();
+        Truncate();
+    }
+    close(m_fd);
     delete m_db_header;
 }
 
+// make the file match memory: dirty nodes, then the bitmap on pages the
+// last checkpoint does not use, then the header in the other slot.
+// Until the header is on disk the journal can undo every page written
+// since the last one, and the pages that one still needs stay taken
+int Pager::Checkpoint()
+{
+    std::vector<std::shared_ptr<MemPage>> dirty;
+    for (MemPage *p = m_lru_head; p; p = p->lru_next)
+    {
+        if (p->dirty)
+            dirty.push_back(m_pages[p->header.page_no]);
+    }
+    WriteBack(dirty);
+    // the journal of the changes after this checkpoint starts here
+    int64_t head = AllocJournal(1);
+    PageBitmap saved;
+    SaveBitmap(saved);
+
+    // writes the flusher issued without the tree lock are done too
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    int ret = 0;
+    if (m_sync_mode != SYNC_OFF && fdatasync(m_fd) != 0)
+        ret = -1;
+    m_db_header->seq++;
+    m_db_header->journal_page = head;
+    WriteHeader();
+    if (m_sync_mode != SYNC_OFF && fdatasync(m_fd) != 0)
+        ret = -1;
+
+    m_bitmap.Subtract(m_pending);
+    m_bitmap.Set(head);
+    m_pending.Reset(0);
+    m_pending.Set(head);
+    m_pending_pages = 1;
+    m_stable = saved;
+    m_journaled.Reset(0);
+    m_journal_next = head;
+    m_changed = false;
+    m_stats.Add(CHECKPOINTS);
+    return ret;
+}
+
+// the pending pages are the price of being able to go back, a
+// checkpoint gives them back once they are a good share of the file
+bool Pager::CheckpointDue()
+{
+    return m_pending_pages > std::max(PENDING_MIN, m_db_header->total_pages / PENDING_SHARE);
+}
+
+void Pager::WriteHeader()
+{
+    m_db_header->checksum = 0;
+    m_db_header->checksum = Crc32c((char *)m_db_header, sizeof(DBHeader));
+    int64_t slot = m_db_header->seq % HEADER_SLOTS;
+    pwrite(m_fd, (char *)m_db_header, sizeof(DBHeader), slot * (PG_SIZE / HEADER_SLOTS));
+}
+
+bool Pager::ReadHeader(int fd, int slot, DBHeader &header)
+{
+    if (pread(fd, (char *)&header, sizeof(DBHeader), slot * (PG_SIZE / HEADER_SLOTS)) !=
+            (ssize_t)sizeof(DBHeader))
+        return false;
+    uint32_t checksum = header.checksum;
+    header.checksum = 0;
+    return header.magic == DB_MAGIC && header.seq % HEADER_SLOTS == slot &&
+        Crc32c((char *)&header, sizeof(DBHeader)) == checksum;
+}
+
+void Pager::LoadBitmap()
+{
+    int64_t total = m_db_header->total_pages;
+    int64_t cnt = m_db_header->bitmap_pages;
+    std::string buf(std::max(cnt, (int64_t)0) * PG_SIZE, 0);
+    std::string bits;
+    if (m_db_header->bitmap_page > 0)
+    {
+        ReadPages(m_db_header->bitmap_page, cnt, &buf[0]);
+        for (int64_t i = 0; i < cnt; ++i)
+        {
+            if (!CheckPage(&buf[i * PG_SIZE], m_db_header->bitmap_page + i))
+                break;
+            bits.append(&buf[i * PG_SIZE + PH_SIZE], PAGE_CAPA);
+        }
+    }
+    if ((int64_t)bits.size() < cnt * PAGE_CAPA || cnt == 0)
+    {
+        // no usable bitmap, every page is taken until a vacuum
+        if (cnt > 0)
+            fprintf(stderr, "fishdb: allocation bitmap is corrupt, free pages are lost\n");
+        m_bitmap.Reset(total);
+        m_bitmap.Set(0, total);
+        m_bitmap_lost = true;
+        return;
+    }
+    m_bitmap.Decode(bits.data(), total);
+    m_bitmap_lost = false;
+}
+
+// saved is the bitmap as written: pages pending a checkpoint are free
+void Pager::SaveBitmap(PageBitmap &saved)
+{
+    // the bitmap has to cover its own pages too, on pages the current
+    // header does not use, the last bitmap's among them
+    int64_t start = 0;
+    int64_t cnt = 1;
+    while (true)
+    {
+        start = FindFresh(cnt);
+        int64_t total = std::max(m_db_header->total_pages, start + cnt);
+        int64_t need = ((total + 63) / 64 * 8 + PAGE_CAPA - 1) / PAGE_CAPA;
+        if (need <= cnt) break;
+        cnt = need;
+    }
+    m_bitmap.Set(start, cnt);
+    if (start + cnt > m_db_header->total_pages)
+        m_db_header->total_pages = start + cnt;
+    if (m_db_header->bitmap_page > 0)
+        FreePages(m_db_header->bitmap_page, m_db_header->bitmap_pages);
+
+    saved = m_bitmap;
+    saved.Subtract(m_pending);
+    std::string bits;
+    saved.Encode(bits);
+    bits.resize(cnt * PAGE_CAPA, 0);
+    std::string buf(cnt * PG_SIZE, 0);
+    for (int64_t i = 0; i < cnt; ++i)
+    {
+        PageHeader header;
+        memset(&header, 0, sizeof(header));
+        header.page_no = start + i;
+        header.type = META_PAGE;
+        header.next_free = -1;
+        header.of_page_no = (i < cnt - 1) ? start + i + 1 : -1;
+        header.data_size = PAGE_CAPA;
+        header.page_cnt = (i == 0) ? cnt : 1;
+        memcpy(&buf[i * PG_SIZE], &header, PH_SIZE);
+        memcpy(&buf[i * PG_SIZE + PH_SIZE], &bits[i * PAGE_CAPA], PAGE_CAPA);
+    }
+    WritePages(start, cnt, &buf[0]);
+    m_db_header->bitmap_page = start;
+    m_db_header->bitmap_pages = cnt;
+}
+
 std::shared_ptr<MemPage> Pager::GetRoot()
 {
     if (m_db_header->root_page == -1)
@@ -65,22 +274,14 @@ std::shared_ptr<MemPage> Pager::GetRoot()
 
 void Pager::SetRoot(int64_t root_page)
 {
+    m_changed = true;
     m_db_header->root_page = root_page;
 }
 
 std::shared_ptr<MemPage> Pager::NewPage(PageType type)
 {
-    std::shared_ptr<MemPage> mp;
-    if (m_db_header->free_list != -1)
-    {
-        mp = ReadPage(m_db_header->free_list);
-        m_db_header->free_list = mp->header.next_free;
-    }
-    else
-    {
-        mp = std::make_shared<MemPage>();
-        mp->header.page_no = m_db_header->total_pages++;
-    }
+    auto mp = std::make_shared<MemPage>();
+    mp->header.page_no = AllocPages(1);
     // init page
     auto &header = mp->header;
     header.type = type;
@@ -89,10 +290,13 @@ std::shared_ptr<MemPage> Pager::NewPage(PageType type)
     header.data_size = 0;
     header.page_cnt = 1;
     header.is_leaf = true;
+    header.flags = (m_db_header->key_mode == KEY_U64) ? PF_U64_KEYS : 0;
 
-    if (type == TREE_PAGE &&
-            m_pages.find(mp->header.page_no) == m_pages.end())
+    if (type == TREE_PAGE)
+    {
         CachePage(mp);
+        MarkDirty(mp);
+    }
 
     return mp;
 }
@@ -100,128 +304,972 @@ std::shared_ptr<MemPage> Pager::NewPage(PageType type)
 std::shared_ptr<MemPage> Pager::GetPage(int64_t page_no, bool stick)
 {
     assert(page_no > 0);
-    auto iter = m_pages.find(page_no);
     std::shared_ptr<MemPage> mp;
-    if (iter != m_pages.end())
     {
-        mp = iter->second;
+        std::lock_guard<std::mutex> lock(m_cache_mutex);
+        auto iter = m_pages.find(page_no);
+        if (iter != m_pages.end())
+        {
+            m_stats.Add(CACHE_HIT);
+            mp = iter->second;
+            LruUnlink(mp.get());
+            LruPushFront(mp.get());
+        }
     }
-    else
+    if (!mp)
     {
-        // read page(s) from file
+        // the read runs unlocked so readers miss in parallel
+        // read page(s) from file, overflow pages are one extent
+        m_stats.Add(CACHE_MISS);
+        PERF_COUNTER_ADD(cache_misses, 1);
         mp = ReadPage(page_no);
         assert(mp != nil);
         int64_t of_page_no = mp->header.of_page_no;
-        while (of_page_no > 0)
+        int64_t cnt = mp->header.page_cnt - 1;
+        if (of_page_no > 0 && cnt > 0)
         {
-            auto of_mp = ReadPage(of_page_no);
-            mp->Feed(of_mp->data.c_str(), of_mp->data.size());
-            of_page_no = of_mp->header.of_page_no;
+            m_stats.Add(OVERFLOW_NODES_READ);
+            m_stats.Add(OVERFLOW_PAGES_READ, cnt);
+            // readers miss in parallel, each reuses its own buffer
+            static thread_local std::string buf;
+            if ((int64_t)buf.size() < cnt * PG_SIZE)
+                buf.resize(cnt * PG_SIZE);
+            ReadPages(of_page_no, cnt, &buf[0]);
+            for (int64_t i = 0; i < cnt; ++i)
+            {
+                if (!CheckPage(&buf[i * PG_SIZE], of_page_no + i))
+                {
+                    mp = BadPage(page_no);
+                    break;
+                }
+                mp->Feed(&buf[i * PG_SIZE + PH_SIZE], PAGE_CAPA);
+            }
         }
         if (mp->header.type == TREE_PAGE)
         {
-            mp->Parse();
-            CachePage(mp);
+            {
+                PERF_TIMER_GUARD(parse_nanos);
+                mp->Parse();
+            }
+            std::lock_guard<std::mutex> lock(m_cache_mutex);
+            auto iter = m_pages.find(page_no);
+            if (iter != m_pages.end())
+                mp = iter->second;      // another reader cached it first
+            else
+                CachePage(mp);
         }
     }
-    mp->stick |= stick;
+    if (stick)
+        mp->stick = true;
     return mp;
 }
 
 void Pager::FlushPage(std::shared_ptr<MemPage> mp)
 {
-    char buf[PG_SIZE * 100];
+    std::vector<PageRun> runs;
+    EncodePage(mp, runs);
+    WriteRuns(runs);
+}
+
+// allocate the pages of a node and lay out their images, the head page
+// and the overflow extent are one run when adjacent
+void Pager::EncodePage(std::shared_ptr<MemPage> mp, std::vector<PageRun> &runs)
+{
     assert(mp->header.type == TREE_PAGE);
     int64_t page_no = mp->header.page_no;
+    std::string image(mp->SerializedSize(), 0);
+    const char *buf = &image[0];
     int size = 0;
-    mp->Serialize(buf, size);
+    mp->Serialize(&image[0], size);
+    assert(size == (int)image.size());
     int data_size = size - PH_SIZE;
     int page_cnt = data_size / PAGE_CAPA + (data_size % PAGE_CAPA > 0);
 
-    std::vector<std::shared_ptr<MemPage>> pages;
-    mp->header.page_cnt = page_cnt;
-    pages.push_back(mp);
-    auto p = ReadPage(page_no);
-    while (p && p->header.of_page_no > 0)
+    // keep the overflow extent of the last flush when it still fits,
+    // grow it in place if the pages after it are free
+    int64_t of_page_no = mp->header.of_page_no;
+    int64_t have = (of_page_no > 0) ? mp->header.page_cnt - 1 : 0;
+    int64_t need = page_cnt - 1;
+    if (need < have)
     {
-        p = ReadPage(p->header.of_page_no);
-        pages.push_back(p);
+        FreePages(of_page_no + need, have - need);
     }
-    int diff = page_cnt - (int)pages.size();
-    for (int i = 0; i < diff; ++i)
-        pages.push_back(NewPage(OF_PAGE));
+    else if (need > have)
+    {
+        if (have > 0 && m_bitmap.IsFree(of_page_no + have, need - have))
+        {
+            m_bitmap.Set(of_page_no + have, need - have);
+            if (of_page_no + need > m_db_header->total_pages)
+                m_db_header->total_pages = of_page_no + need;
+        }
+        else
+        {
+            if (have > 0)
+                FreePages(of_page_no, have);
+            of_page_no = AllocPages(need, page_no + 1);
+        }
+    }
+    if (need == 0)
+        of_page_no = -1;
+    mp->header.of_page_no = of_page_no;
+    mp->header.page_cnt = page_cnt;
+    mp->header.data_size = data_size;
 
-    // FIXME page leak
-    assert((int)pages.size() >= page_cnt);
+    std::string out(page_cnt * PG_SIZE, 0);
     for (int i = 0; i < page_cnt; ++i)
     {
-        auto &p = pages[i];
-        int64_t base = PH_SIZE + i * PAGE_CAPA;
-        p->Clear();
-        p->Feed(buf + base, PAGE_CAPA);
-        if (i < page_cnt - 1)
+        PageHeader header = mp->header;
+        if (i > 0)
         {
-            p->header.of_page_no = pages[i + 1]->header.page_no;
+            // overflow pages remember their node, vacuum needs it
+            header.page_no = of_page_no + i - 1;
+            header.type = OF_PAGE;
+            header.next_free = page_no;
+            header.page_cnt = 1;
+            header.of_page_no = (i < page_cnt - 1) ? header.page_no + 1 : -1;
         }
-        else
-            p->header.of_page_no = -1;
-        WritePage(p);
+        int len = std::min((int)PAGE_CAPA, data_size - i * PAGE_CAPA);
+        memcpy(&out[i * PG_SIZE], &header, PH_SIZE);
+        memcpy(&out[i * PG_SIZE + PH_SIZE], buf + PH_SIZE + i * PAGE_CAPA, len);
     }
+    if (need == 0 || of_page_no == page_no + 1)
+    {
+        runs.push_back(PageRun());
+        runs.back().page_no = page_no;
+        runs.back().cnt = page_cnt;
+        runs.back().image.swap(out);
+    }
+    else
+    {
+        runs.push_back(PageRun());
+        runs.back().page_no = page_no;
+        runs.back().cnt = 1;
+        runs.back().image = out.substr(0, PG_SIZE);
+        runs.push_back(PageRun());
+        runs.back().page_no = of_page_no;
+        runs.back().cnt = need;
+        runs.back().image = out.substr(PG_SIZE);
+    }
+    if (mp->dirty && Cached(mp.get()))
+        m_dirty_pages--;
+    mp->dirty = false;
 }
 
-void Pager::FreePage(std::shared_ptr<MemPage> mp)
+static bool RunBefore(const PageRun &a, const PageRun &b)
+{
+    return a.page_no < b.page_no;
+}
+
+static bool PageBefore(const std::shared_ptr<MemPage> &a, const std::shared_ptr<MemPage> &b)
+{
+    return a->header.page_no < b->header.page_no;
+}
+
+// write in file order, runs that touch or are only a few free pages
+// apart go out as one pwritev
+void Pager::WriteRuns(std::vector<PageRun> &runs)
+{
+    std::vector<WriteCall> calls;
+    PlanWrites(runs, calls);
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    IssueWrites(calls);
+    runs.clear();
+}
+
+// seal the images and group them into calls. The calls point into
+// runs, keep it until they are issued
+void Pager::PlanWrites(std::vector<PageRun> &runs, std::vector<WriteCall> &calls)
 {
-    while (mp)
+    static const std::string zeros(WRITEBACK_GAP * PG_SIZE, 0);
+    std::sort(runs.begin(), runs.end(), RunBefore);
+    size_t i = 0;
+    while (i < runs.size())
+    {
+        calls.push_back(WriteCall());
+        WriteCall &call = calls.back();
+        call.page_no = runs[i].page_no;
+        call.end = call.page_no;
+        call.pages = 0;
+        while (i < runs.size() && call.iov.size() + 1 < IOV_MAX)
+        {
+            int64_t gap = runs[i].page_no - call.end;
+            if (gap > 0 && (gap > WRITEBACK_GAP || !m_bitmap.IsFree(call.end, gap)))
+                break;
+            struct iovec v;
+            if (gap > 0)
+            {
+                v.iov_base = (void *)zeros.data();
+                v.iov_len = gap * PG_SIZE;
+                call.iov.push_back(v);
+            }
+            SealPages(&runs[i].image[0], runs[i].cnt);
+            v.iov_base = &runs[i].image[0];
+            v.iov_len = runs[i].cnt * PG_SIZE;
+            call.iov.push_back(v);
+            call.end = runs[i].page_no + runs[i].cnt;
+            call.pages += runs[i].cnt;
+            ++i;
+        }
+    }
+    for (size_t c = 0; c < calls.size(); ++c)
+        PlanJournal(calls[c].page_no, calls[c].end, calls[0].journal);
+}
+
+void Pager::IssueWrites(std::vector<WriteCall> &calls)
+{
+    for (size_t i = 0; i < calls.size(); ++i)
+    {
+        WriteCall &call = calls[i];
+        SaveJournal(call.journal);
+        BeforeWrite(call.page_no, call.end);
+        {
+            PERF_TIMER_GUARD(write_nanos);
+            pwritev(m_fd, &call.iov[0], call.iov.size(), call.page_no * PG_SIZE);
+        }
+        m_stats.Add(WRITE_CALLS);
+        m_stats.Add(PAGES_WRITTEN, call.pages);
+        m_stats.Add(BYTES_WRITTEN, (call.end - call.page_no) * PG_SIZE);
+        if (call.end * PG_SIZE > m_file_size)
+            m_file_size = call.end * PG_SIZE;
+    }
+    calls.clear();
+}
+
+// pages [page_no, end) are about to change on disk: note them for the
+// next incremental backup and keep the images a running backup has yet
+// to copy. Called under m_write_mutex
+void Pager::BeforeWrite(int64_t page_no, int64_t end)
+{
+    m_backup_changed.Set(page_no, end - page_no);
+    BackupState *b = m_backup;
+    if (!b) return;
+    for (int64_t i = std::max(page_no, b->cursor); i < end; ++i)
+    {
+        i = b->pages.NextUsed(i);
+        if (i >= end || i >= b->pages.Size()) break;
+        if (b->saved.count(i)) continue;
+        std::string &image = b->saved[i];
+        image.resize(PG_SIZE);
+        pread(m_fd, &image[0], PG_SIZE, i * PG_SIZE);
+        m_stats.Add(BACKUP_SAVED_PAGES);
+    }
+}
+
+// pick the pages in [page_no, end) the last checkpoint uses whose old
+// images the journal does not have yet, and make room for them and
+// their directories. Needs the tree lock, SaveJournal does the I/O
+void Pager::PlanJournal(int64_t page_no, int64_t end, std::vector<JournalGroup> &groups)
+{
+    std::vector<int64_t> pages;
+    end = std::min(end, m_stable.Size());
+    for (int64_t i = m_stable.NextUsed(page_no); i < end; i = m_stable.NextUsed(i + 1))
+    {
+        if (m_journaled.Test(i) || m_pending.Test(i)) continue;
+        m_journaled.Set(i);
+        pages.push_back(i);
+    }
+    for (size_t i = 0; i < pages.size(); i += JOURNAL_ENTRIES)
     {
-        auto header = mp->header;
-        int64_t of_page_no = header.of_page_no;
-        header.type = FREE_PAGE;
-        header.of_page_no = -1;
-        header.data_size = 0;
+        assert(m_journal_next > 0);
+        groups.push_back(JournalGroup());
+        JournalGroup &g = groups.back();
+        size_t last = std::min(pages.size(), i + JOURNAL_ENTRIES);
+        g.pages.assign(pages.begin() + i, pages.begin() + last);
+        g.dir = m_journal_next;
+        g.images = AllocJournal(g.pages.size());
+        g.next = AllocJournal(1);
+        m_journal_next = g.next;
+    }
+}
+
+// the old images go to their run, then the directory that lists them
+// and their crcs. Synced before the caller overwrites the pages. Called
+// under m_write_mutex
+void Pager::SaveJournal(std::vector<JournalGroup> &groups)
+{
+    if (groups.empty()) return;
+    for (size_t i = 0; i < groups.size(); ++i)
+    {
+        JournalGroup &g = groups[i];
+        int64_t cnt = g.pages.size();
+        std::string images(cnt * PG_SIZE, 0);
+        std::string dir(PG_SIZE, 0);
+        PageHeader header;
+        memset(&header, 0, sizeof(header));
+        header.page_no = g.dir;
+        header.type = JOURNAL_PAGE;
+        header.next_free = -1;
+        header.of_page_no = g.next;
+        header.data_size = cnt;
         header.page_cnt = 1;
-        header.next_free = m_db_header->free_list;
-        m_db_header->free_list = header.page_no;
-        WritePage(mp);
-        mp = ReadPage(of_page_no);
+        memcpy(&dir[0], &header, PH_SIZE);
+        char *p = &dir[PH_SIZE];
+        p += EncodeInt64(p, m_db_header->seq);
+        p += EncodeInt64(p, g.images);
+        for (int64_t j = 0; j < cnt; ++j)
+        {
+            char *image = &images[j * PG_SIZE];
+            ReadPages(g.pages[j], 1, image);
+            p += EncodeInt64(p, g.pages[j]);
+            p += EncodeInt64(p, Crc32c(image, PG_SIZE));
+        }
+        SealPages(&dir[0], 1);
+        BeforeWrite(g.images, g.images + cnt);
+        BeforeWrite(g.dir, g.dir + 1);
+        {
+            PERF_TIMER_GUARD(write_nanos);
+            pwrite(m_fd, images.data(), cnt * PG_SIZE, g.images * PG_SIZE);
+            pwrite(m_fd, dir.data(), PG_SIZE, g.dir * PG_SIZE);
+        }
+        m_stats.Add(WRITE_CALLS, 2);
+        m_stats.Add(PAGES_WRITTEN, cnt + 1);
+        m_stats.Add(BYTES_WRITTEN, (cnt + 1) * PG_SIZE);
+        m_stats.Add(JOURNAL_PAGES, cnt);
+        int64_t end = std::max(g.images + cnt, g.dir + 1) * PG_SIZE;
+        if (end > m_file_size)
+            m_file_size = end;
     }
-} 
+    if (m_sync_mode != SYNC_OFF)
+        fdatasync(m_fd);
+    groups.clear();
+}
 
-void Pager::Prune(int size_limit, bool force)
+// roll the file back to the checkpoint the header describes by putting
+// back the images its journal saved. A directory that fails its check
+// or is from another checkpoint ends the journal, an image that does
+// not match its crc was never written over its page
+bool Pager::Recover()
 {
-    std::vector<int64_t> ps;
-    for (auto iter = m_pages.begin(); iter != m_pages.end(); ++iter)
+    bool restored = false;
+    std::string dir(PG_SIZE, 0);
+    int64_t dir_page = m_db_header->journal_page;
+    while (dir_page > 0 && (dir_page + 1) * PG_SIZE <= m_file_size)
     {
-        if ((int)m_pages.size() <= size_limit) break;
-        auto mp = iter->second;
-        if (mp->stick && !force) continue;
-        FlushPage(mp);
-        ps.push_back(iter->first);
+        ReadPages(dir_page, 1, &dir[0]);
+        PageHeader *header = (PageHeader *)&dir[0];
+        if (!CheckPage(&dir[0], dir_page) || header->type != JOURNAL_PAGE ||
+                header->data_size > JOURNAL_ENTRIES)
+            break;
+        char *p = &dir[PH_SIZE];
+        int64_t seq, images_page;
+        p += DecodeInt64(p, seq);
+        p += DecodeInt64(p, images_page);
+        if (seq != m_db_header->seq) break;
+        int64_t cnt = header->data_size;
+        std::string images(cnt * PG_SIZE, 0);
+        ReadPages(images_page, cnt, &images[0]);
+        for (int64_t i = 0; i < cnt; ++i)
+        {
+            int64_t page_no, crc;
+            p += DecodeInt64(p, page_no);
+            p += DecodeInt64(p, crc);
+            if (Crc32c(&images[i * PG_SIZE], PG_SIZE) != (uint32_t)crc) continue;
+            pwrite(m_fd, &images[i * PG_SIZE], PG_SIZE, page_no * PG_SIZE);
+            restored = true;
+        }
+        dir_page = header->of_page_no;
     }
-    for (size_t i = 0; i < ps.size(); ++i)
-        m_pages.erase(ps[i]);
+    if (restored)
+        fdatasync(m_fd);
+    return restored;
 }
 
-void Pager::CachePage(std::shared_ptr<MemPage> mp)
+// snapshot the file for a backup to path. A checkpoint puts every
+// change on disk, then the pages to copy are the used ones or, over the
+// last backup to the same path if the file still holds it, those
+// written since
+int Pager::BeginBackup(const std::string &path, bool incremental)
+{
+    if (m_backup) return -1;
+    if (Checkpoint() != 0) return -1;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    DBHeader base;
+    bool from_base = incremental && path == m_backup_path && m_backup_seq > 0 &&
+        ReadHeader(fd, m_backup_seq % HEADER_SLOTS, base) && base.seq == m_backup_seq;
+    if (!from_base)
+        ftruncate(fd, 0);
+
+    BackupState *b = new BackupState();
+    b->fd = fd;
+    b->header = *m_db_header;
+    b->header.journal_page = -1;
+    b->pages = m_bitmap;
+    b->pages.Subtract(m_pending);
+    b->pages.Clear(0);      // the header goes last
+    b->cursor = 1;
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    if (from_base)
+        b->pages.Intersect(m_backup_changed);
+    m_backup_changed.Reset(0);
+    m_backup = b;
+    m_backup_path = path;
+    m_backup_seq = 0;       // no base until this one is done
+    return 0;
+}
+
+// copy the snapshot in file order with large reads. A read holds the
+// write mutex so no page changes under it, pages overwritten before
+// their turn come from the saved images. The header is written last
+int Pager::CopyBackup()
+{
+    BackupState *b = m_backup;
+    int64_t total = b->header.total_pages;
+    int64_t last = std::min(total, b->pages.Size());
+    std::string buf;
+    bool ok = true;
+    int64_t page_no = b->pages.NextUsed(b->cursor);
+    while (ok && page_no < last)
+    {
+        int64_t end = std::min(page_no + BACKUP_CHUNK, last);
+        buf.assign((end - page_no) * PG_SIZE, 0);
+        {
+            std::lock_guard<std::mutex> lock(m_write_mutex);
+            ReadPages(page_no, end - page_no, &buf[0]);
+            b->cursor = end;
+            auto iter = b->saved.lower_bound(page_no);
+            while (iter != b->saved.end() && iter->first < end)
+            {
+                memcpy(&buf[(iter->first - page_no) * PG_SIZE], iter->second.data(), PG_SIZE);
+                b->saved.erase(iter++);
+            }
+        }
+        // only the listed pages, others may be newer than the snapshot
+        for (int64_t p = page_no; p < end; p = b->pages.NextUsed(p))
+        {
+            int64_t q = p;
+            while (q < end && b->pages.Test(q))
+                ++q;
+            ssize_t len = (q - p) * PG_SIZE;
+            if (pwrite(b->fd, &buf[(p - page_no) * PG_SIZE], len, p * PG_SIZE) != len)
+                ok = false;
+            m_stats.Add(BACKUP_PAGES, q - p);
+            p = q;
+        }
+        page_no = b->pages.NextUsed(end);
+    }
+
+    DBHeader header = b->header;
+    header.checksum = 0;
+    header.checksum = Crc32c((char *)&header, sizeof(DBHeader));
+    std::string head(PG_SIZE, 0);
+    memcpy(&head[(header.seq % HEADER_SLOTS) * (PG_SIZE / HEADER_SLOTS)], &header, sizeof(DBHeader));
+    if (ok && m_sync_mode != SYNC_OFF && fdatasync(b->fd) != 0)
+        ok = false;
+    if (ok && pwrite(b->fd, head.data(), PG_SIZE, 0) != PG_SIZE)
+        ok = false;
+    if (ok && ftruncate(b->fd, total * PG_SIZE) != 0)
+        ok = false;
+    if (ok && m_sync_mode != SYNC_OFF && fdatasync(b->fd) != 0)
+        ok = false;
+    close(b->fd);
+
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    m_backup = NULL;
+    if (ok)
+        m_backup_seq = header.seq;
+    delete b;
+    return ok ? 0 : -1;
+}
+
+// encode the least recently used dirty nodes, up to max_nodes of them,
+// until no more than target stay dirty. They stay cached and held in
+// held until their images are written, so nobody reads them from disk
+int64_t Pager::CollectDirty(int64_t target, int64_t max_nodes,
+        std::vector<std::shared_ptr<MemPage>> &held, std::vector<PageRun> &runs)
+{
+    int64_t cnt = 0;
+    for (MemPage *p = m_lru_tail; p && m_dirty_pages > target && cnt < max_nodes; p = p->lru_prev)
+    {
+        if (!p->dirty) continue;
+        auto iter = m_pages.find(p->header.page_no);
+        assert(iter != m_pages.end() && iter->second.get() == p);
+        held.push_back(iter->second);
+        EncodePage(iter->second, runs);
+        cnt++;
+    }
+    return cnt;
+}
+
+int Pager::PageCount(std::shared_ptr<MemPage> mp)
 {
-    m_pages.insert(std::make_pair(mp->header.page_no, mp));
+    int data_size = mp->SerializedSize() - PH_SIZE;
+    return data_size / PAGE_CAPA + (data_size % PAGE_CAPA > 0);
 }
 
-void Pager::WritePage(std::shared_ptr<MemPage> mp)
+void Pager::ChainPages(std::shared_ptr<MemPage> mp, std::vector<int64_t> &pages)
+{
+    pages.push_back(mp->header.page_no);
+    int64_t of_page_no = mp->header.of_page_no;
+    for (int i = 1; of_page_no > 0 && i < mp->header.page_cnt; ++i)
+        pages.push_back(of_page_no + i - 1);
+}
+
+void Pager::FreePage(std::shared_ptr<MemPage> mp)
+{
+    m_evict_seq++;
+    UncachePage(mp->header.page_no);
+    FreePages(mp->header.page_no, 1);
+    if (mp->header.of_page_no > 0)
+        FreePages(mp->header.of_page_no, mp->header.page_cnt - 1);
+}
+
+// pages the last checkpoint uses are freed by the next one, a crash
+// before it needs them. A vacuum has to reuse them at once, it frees
+// them and the journal saves them before they are overwritten
+void Pager::FreePages(int64_t page_no, int64_t cnt)
+{
+    for (int64_t i = page_no; i < page_no + cnt; ++i)
+    {
+        if (!m_vacuum && m_stable.Test(i))
+        {
+            if (!m_pending.Test(i))
+                m_pending_pages++;
+            m_pending.Set(i);
+        }
+        else
+            m_bitmap.Clear(i);
+    }
+}
+
+// the bitmap is trusted as the allocator trusts it. The saved bitmap's
+// own pages are given up, the next checkpoint saves it elsewhere
+void Pager::BeginVacuum()
+{
+    m_vacuum = true;
+    if (m_db_header->bitmap_page > 0)
+        FreePages(m_db_header->bitmap_page, m_db_header->bitmap_pages);
+    m_db_header->bitmap_page = -1;
+    m_db_header->bitmap_pages = 0;
+    m_vacuum_frontier = 1;
+    m_alloc_floor = 1;
+}
+
+// every page not reachable from the root is free, including leaked
+// ones and the saved bitmap, but not the pending ones
+void Pager::BeginVacuum(const std::set<int64_t> &live)
+{
+    m_bitmap.Reset(m_db_header->total_pages);
+    m_bitmap.Set(0);
+    for (auto iter = live.begin(); iter != live.end(); ++iter)
+        m_bitmap.Set(*iter);
+    for (int64_t p = m_pending.NextUsed(0); p < m_pending.Size(); p = m_pending.NextUsed(p + 1))
+        m_bitmap.Set(p);
+    m_bitmap_lost = false;
+    BeginVacuum();
+}
+
+void Pager::EndVacuum()
+{
+    assert(m_vacuum);
+    // the pages nodes moved off are the last checkpoint's, a checkpoint
+    // frees them. The second one puts its journal below the new end if
+    // there is room
+    m_vacuum = false;
+    Checkpoint();
+    Checkpoint();
+    Truncate();
+}
+
+// cut the free pages off the end of the file
+void Pager::Truncate()
+{
+    int64_t total = m_bitmap.LastUsed() + 1;
+    m_bitmap.Truncate(total);
+    m_db_header->total_pages = total;
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    BeforeWrite(total, m_file_size / PG_SIZE);
+    ftruncate(m_fd, total * PG_SIZE);
+    m_file_size = total * PG_SIZE;
+}
+
+// head page of the node stored on page_no, -1 if the page is free
+int64_t Pager::PageOwner(int64_t page_no)
+{
+    if (!m_bitmap.Test(page_no)) return -1;
+    int64_t bitmap_page = m_db_header->bitmap_page;
+    if (page_no >= bitmap_page && page_no < bitmap_page + m_db_header->bitmap_pages)
+    {
+        // a checkpoint saved the bitmap here meanwhile. Give the pages
+        // up as BeginVacuum does, the next checkpoint saves it elsewhere
+        FreePages(bitmap_page, m_db_header->bitmap_pages);
+        m_db_header->bitmap_page = -1;
+        m_db_header->bitmap_pages = 0;
+        return -1;
+    }
+    if (m_pages.find(page_no) != m_pages.end()) return page_no;
+    {
+        // the flusher may still be writing this overflow page, wait it out
+        std::lock_guard<std::mutex> wait(m_write_mutex);
+    }
+    auto mp = ReadPage(page_no);
+    if (!mp) return -1;
+    if (mp->header.type == OF_PAGE) return mp->header.next_free;
+    return page_no;
+}
+
+// rewrite a node on the lowest free pages at or above floor
+void Pager::MovePage(std::shared_ptr<MemPage> mp, int64_t floor)
+{
+    assert(m_vacuum);
+    FreePage(mp);
+
+    m_alloc_floor = floor;
+    mp->header.page_no = AllocPages(1);
+    mp->header.of_page_no = -1;
+    mp->header.page_cnt = 1;
+    CachePage(mp);
+    FlushPage(mp);
+    m_alloc_floor = 1;
+}
+
+// lowest run of cnt free pages the last checkpoint does not use either,
+// at or above the floor. Outside a vacuum every free page is one, frees
+// wait for a checkpoint
+int64_t Pager::FindFresh(int64_t cnt)
+{
+    int64_t page_no = m_bitmap.FindRun(cnt, m_alloc_floor);
+    if (!m_stable.IsFree(page_no, cnt))
+        page_no = m_bitmap.FindRun(cnt, m_stable.Size());
+    return page_no;
+}
+
+// journal pages are free again once the next checkpoint is on disk
+int64_t Pager::AllocJournal(int64_t cnt)
+{
+    int64_t page_no = FindFresh(cnt);
+    m_bitmap.Set(page_no, cnt);
+    m_pending.Set(page_no, cnt);
+    m_pending_pages += cnt;
+    if (page_no + cnt > m_db_header->total_pages)
+        m_db_header->total_pages = page_no + cnt;
+    return page_no;
+}
+
+// lowest run of cnt free pages at or above the floor, prefer is taken
+// when it is free so overflow pages follow their head
+int64_t Pager::AllocPages(int64_t cnt, int64_t prefer)
+{
+    int64_t page_no;
+    if (prefer >= m_alloc_floor && m_bitmap.IsFree(prefer, cnt))
+        page_no = prefer;
+    else
+        page_no = m_bitmap.FindRun(cnt, m_alloc_floor);
+    m_bitmap.Set(page_no, cnt);
+    if (page_no + cnt > m_db_header->total_pages)
+        m_db_header->total_pages = page_no + cnt;
+    return page_no;
+}
+
+// the caller changes mp in this operation, it gets written before it
+// leaves the cache and its charge is refreshed at the next Prune
+void Pager::MarkDirty(std::shared_ptr<MemPage> mp)
+{
+    m_changed = true;
+    if (!mp->dirty && Cached(mp.get()))
+        m_dirty_pages++;
+    mp->dirty = true;
+    if (!mp->touched)
+    {
+        mp->touched = true;
+        m_touched.push_back(mp);
+    }
+}
+
+// evict least recently used pages until the cache is within limit bytes.
+// Call it between operations only: a page someone still holds or a
+// sticky one stays, unless force, which flushes and drops everything.
+// Without flush dirty pages stay too, for readers sharing the tree
+void Pager::Prune(int64_t limit, bool force, bool flush)
+{
+    PERF_TIMER_GUARD(evict_nanos);
+    std::lock_guard<std::mutex> lock(m_cache_mutex);
+    for (size_t i = 0; i < m_touched.size(); ++i)
+    {
+        auto &mp = m_touched[i];
+        mp->touched = false;
+        auto iter = m_pages.find(mp->header.page_no);
+        if (iter == m_pages.end() || iter->second != mp) continue;
+        int64_t charge = mp->Footprint();
+        m_usage += charge - mp->charge;
+        mp->charge = charge;
+    }
+    m_touched.clear();
+
+    // dirty victims are written back together in file order
+    std::vector<std::shared_ptr<MemPage>> dirty;
+    int64_t evicted = 0;
+    MemPage *p = m_lru_tail;
+    while (p && (force || m_usage > limit))
+    {
+        MemPage *prev = p->lru_prev;
+        auto iter = m_pages.find(p->header.page_no);
+        assert(iter != m_pages.end() && iter->second.get() == p);
+        if (force || (!p->stick && iter->second.use_count() == 1 && (flush || !p->dirty)))
+        {
+            if (p->dirty)
+                dirty.push_back(iter->second);
+            UncachePage(p->header.page_no);
+            evicted++;
+        }
+        p = prev;
+    }
+    WriteBack(dirty);
+    if (evicted > 0)
+    {
+        m_evict_seq++;
+        m_stats.Add(CACHE_EVICTIONS, evicted);
+    }
+}
+
+// encode and write nodes in file order, a batch of images at a time
+void Pager::WriteBack(std::vector<std::shared_ptr<MemPage>> &dirty)
+{
+    std::sort(dirty.begin(), dirty.end(), PageBefore);
+    std::vector<PageRun> runs;
+    int64_t bytes = 0;
+    for (size_t i = 0; i < dirty.size(); ++i)
+    {
+        EncodePage(dirty[i], runs);
+        bytes += dirty[i]->header.page_cnt * PG_SIZE;
+        if (bytes >= WRITEBACK_BATCH || i + 1 == dirty.size())
+        {
+            WriteRuns(runs);
+            bytes = 0;
+        }
+    }
+}
+
+void Pager::SaveWarmList(const std::vector<int64_t> &pages)
+{
+    WarmHeader header;
+    header.magic = WARM_MAGIC;
+    header.count = pages.size();
+    header.checksum = Crc32c((const char *)pages.data(), pages.size() * sizeof(int64_t));
+
+    // write aside and rename, a crash never leaves half a list
+    std::string path = m_path + ".warm";
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp) return;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (!pages.empty())
+        ok = ok && fwrite(pages.data(), sizeof(int64_t), pages.size(), fp) == pages.size();
+    ok = (fclose(fp) == 0) && ok;
+    if (ok)
+        rename(tmp.c_str(), path.c_str());
+    else
+        remove(tmp.c_str());
+}
+
+void Pager::LoadWarmList(std::vector<int64_t> &pages)
+{
+    pages.clear();
+    std::string path = m_path + ".warm";
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) return;
+    WarmHeader header;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == WARM_MAGIC &&
+            header.count > 0 && header.count <= m_db_header->total_pages)
+    {
+        pages.resize(header.count);
+        if (fread(&pages[0], sizeof(int64_t), header.count, fp) != (size_t)header.count ||
+                Crc32c((const char *)pages.data(), header.count * sizeof(int64_t)) != header.checksum)
+            pages.clear();
+    }
+    fclose(fp);
+}
+
+// read cnt pages from page_no on, returns how many were there
+int64_t Pager::WarmRead(int64_t page_no, int64_t cnt, std::string &buf)
+{
+    buf.resize(cnt * PG_SIZE);
+    ssize_t got = pread(m_fd, &buf[0], cnt * PG_SIZE, page_no * PG_SIZE);
+    if (got <= 0) return 0;
+    m_stats.Add(PAGES_READ, got / PG_SIZE);
+    m_stats.Add(BYTES_READ, got);
+    return got / PG_SIZE;
+}
+
+// build the node whose head image is in buf, avail pages are in buf
+// from there on. The list may be stale, anything odd is skipped quietly
+std::shared_ptr<MemPage> Pager::WarmPage(char *buf, int64_t page_no, int64_t avail)
+{
+    if (!CheckPage(buf, page_no)) return nil;
+    auto mp = std::make_shared<MemPage>();
+    memcpy(&mp->header, buf, PH_SIZE);
+    if (mp->header.type != TREE_PAGE) return nil;
+    mp->Feed(buf + PH_SIZE, PAGE_CAPA);
+
+    int64_t of_page_no = mp->header.of_page_no;
+    int64_t cnt = mp->header.page_cnt - 1;
+    if (of_page_no <= 0 || cnt <= 0) return mp;
+    std::string extent;
+    char *of_buf = buf + PG_SIZE;
+    if (of_page_no != page_no + 1 || cnt >= avail)
+    {
+        if (WarmRead(of_page_no, cnt, extent) < cnt) return nil;
+        of_buf = &extent[0];
+    }
+    for (int64_t i = 0; i < cnt; ++i)
+    {
+        if (!CheckPage(of_buf + i * PG_SIZE, of_page_no + i)) return nil;
+        mp->Feed(of_buf + i * PG_SIZE + PH_SIZE, PAGE_CAPA);
+    }
+    return mp;
+}
+
+// cache a node built by WarmPage unless the tree got there first
+bool Pager::InstallPage(std::shared_ptr<MemPage> mp)
 {
     int64_t page_no = mp->header.page_no;
-    auto header = &mp->header;
+    if (m_usage >= m_capacity) return false;
+    if (!m_bitmap.Test(page_no) || m_pending.Test(page_no)) return false;
+    if (m_pages.find(page_no) != m_pages.end()) return false;
+    mp->stick = false;
+    mp->Parse();
+    CachePage(mp);
+    return true;
+}
+
+// tell the kernel which uncached pages are wanted soon, nearby pages
+// are joined into one hint so the reads stay large
+void Pager::Prefetch(std::vector<int64_t> pages)
+{
+    std::vector<int64_t> todo;
+    std::unique_lock<std::mutex> lock(m_cache_mutex);
+    for (size_t i = 0; i < pages.size(); ++i)
+    {
+        if (pages[i] > 0 && m_pages.find(pages[i]) == m_pages.end())
+            todo.push_back(pages[i]);
+    }
+    lock.unlock();
+    std::sort(todo.begin(), todo.end());
+    size_t i = 0;
+    while (i < todo.size())
+    {
+        int64_t first = todo[i];
+        int64_t last = todo[i];
+        for (++i; i < todo.size() && todo[i] - last <= PREFETCH_GAP; ++i)
+            last = todo[i];
+        posix_fadvise(m_fd, first * PG_SIZE, (last - first + 1) * PG_SIZE, POSIX_FADV_WILLNEED);
+    }
+}
+
+void Pager::CachePage(std::shared_ptr<MemPage> mp)
+{
+    if (!m_pages.insert(std::make_pair(mp->header.page_no, mp)).second) return;
+    mp->charge = mp->Footprint();
+    m_usage += mp->charge;
+    if (mp->dirty)
+        m_dirty_pages++;
+    LruPushFront(mp.get());
+}
+
+void Pager::UncachePage(int64_t page_no)
+{
+    auto iter = m_pages.find(page_no);
+    if (iter == m_pages.end()) return;
+    m_usage -= iter->second->charge;
+    if (iter->second->dirty)
+        m_dirty_pages--;
+    LruUnlink(iter->second.get());
+    m_pages.erase(iter);
+}
+
+bool Pager::Cached(const MemPage *mp)
+{
+    auto iter = m_pages.find(mp->header.page_no);
+    return iter != m_pages.end() && iter->second.get() == mp;
+}
+
+void Pager::LruUnlink(MemPage *mp)
+{
+    if (mp->lru_prev) mp->lru_prev->lru_next = mp->lru_next;
+    else m_lru_head = mp->lru_next;
+    if (mp->lru_next) mp->lru_next->lru_prev = mp->lru_prev;
+    else m_lru_tail = mp->lru_prev;
+    mp->lru_prev = mp->lru_next = NULL;
+}
+
+void Pager::LruPushFront(MemPage *mp)
+{
+    mp->lru_prev = NULL;
+    mp->lru_next = m_lru_head;
+    if (m_lru_head) m_lru_head->lru_prev = mp;
+    m_lru_head = mp;
+    if (!m_lru_tail) m_lru_tail = mp;
+}
+
+// every page image is sealed with its checksum on the way out
+void Pager::SealPages(char *buf, int64_t cnt)
+{
+    for (int64_t i = 0; i < cnt; ++i)
+    {
+        PageHeader *header = (PageHeader *)(buf + i * PG_SIZE);
+        header->checksum = 0;
+        header->checksum = Crc32c(buf + i * PG_SIZE, PG_SIZE);
+    }
+}
+
+void Pager::WritePages(int64_t page_no, int64_t cnt, char *buf)
+{
+    SealPages(buf, cnt);
     int64_t offset = page_no * PG_SIZE;
-    if (offset + PG_SIZE > m_file_size)
+    std::vector<JournalGroup> journal;
+    PlanJournal(page_no, page_no + cnt, journal);
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    SaveJournal(journal);
+    BeforeWrite(page_no, page_no + cnt);
     {
-        ftruncate(fileno(m_file), offset + PG_SIZE);
-        m_file_size = offset + PG_SIZE;
+        PERF_TIMER_GUARD(write_nanos);
+        pwrite(m_fd, buf, cnt * PG_SIZE, offset);
     }
+    m_stats.Add(WRITE_CALLS);
+    m_stats.Add(PAGES_WRITTEN, cnt);
+    m_stats.Add(BYTES_WRITTEN, cnt * PG_SIZE);
+    if (offset + cnt * PG_SIZE > m_file_size)
+        m_file_size = offset + cnt * PG_SIZE;
+}
 
-    assert(mp->data.size() <= PAGE_CAPA);
-    fseek(m_file, offset, SEEK_SET);
-    fwrite((void *)header, sizeof(PageHeader), 1, m_file);
-    int len = std::min((int)PAGE_CAPA, (int)mp->data.size());
-    fwrite((void *)mp->data.c_str(), len, 1, m_file);
+void Pager::ReadPages(int64_t page_no, int64_t cnt, char *buf)
+{
+    {
+        PERF_TIMER_GUARD(read_nanos);
+        pread(m_fd, buf, cnt * PG_SIZE, page_no * PG_SIZE);
+    }
+    PERF_COUNTER_ADD(bytes_read, cnt * PG_SIZE);
+    m_stats.Add(PAGES_READ, cnt);
+    m_stats.Add(BYTES_READ, cnt * PG_SIZE);
+}
+
+// true if the image read from page_no is intact and belongs there
+bool Pager::CheckPage(char *buf, int64_t page_no)
+{
+    PageHeader *header = (PageHeader *)buf;
+    uint32_t checksum = header->checksum;
+    header->checksum = 0;
+    bool ok = Crc32c(buf, PG_SIZE) == checksum && header->page_no == page_no;
+    header->checksum = checksum;
+    return ok;
+}
+
+// stands in for a page that failed its check, an empty leaf that is
+// never cached so it is never written back over the damaged page
+std::shared_ptr<MemPage> Pager::BadPage(int64_t page_no)
+{
+    fprintf(stderr, "fishdb: page %" PRId64 " is corrupt\n", page_no);
+    m_corrupt++;
+    m_stats.Add(CORRUPT_PAGES);
+    auto p = std::make_shared<MemPage>();
+    p->header.page_no = page_no;
+    p->header.type = FREE_PAGE;
+    p->header.page_cnt = 1;
+    p->header.of_page_no = -1;
+    p->header.next_free = -1;
+    p->is_leaf = true;
+    p->stick = false;
+    return p;
 }
 
 std::shared_ptr<MemPage> Pager::ReadPage(int64_t page_no)
@@ -233,13 +1281,16 @@ std::shared_ptr<MemPage> Pager::ReadPage(int64_t page_no)
     if (offset + PG_SIZE > m_file_size) return nil;
 
     auto mp = std::make_shared<MemPage>();
-    auto header = &mp->header;
-    fseek(m_file, offset, SEEK_SET);
-    fread((void *)header, sizeof(PageHeader), 1, m_file);
-    fread((void *)buf, PAGE_CAPA, 1, m_file);
-    mp->Feed(buf, PAGE_CAPA);
-    if (mp->header.page_no != page_no)
+    ReadPages(page_no, 1, buf);
+    memcpy(&mp->header, buf, PH_SIZE);
+    if (!CheckPage(buf, page_no))
     {
+        // a page that was allocated but never written reads as zeros
+        for (int i = 0; i < PG_SIZE; ++i)
+        {
+            if (buf[i] != 0)
+                return BadPage(page_no);
+        }
         auto p = std::make_shared<MemPage>();
         p->header.page_no = page_no;
         p->header.page_cnt = 1;
@@ -247,6 +1298,8 @@ std::shared_ptr<MemPage> Pager::ReadPage(int64_t page_no)
         p->header.next_free = -1;
         return p;
     }
+    // the header is trusted from here, Feed sizes the image by it
+    mp->Feed(buf + PH_SIZE, PAGE_CAPA);
     return mp;
 }
 
@@ -2,23 +2,89 @@
 #define PAGER_H_
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <atomic>
 #include <assert.h>
+#include <sys/uio.h>
 #include "util.h"
 #include "page.h"
+#include "bitmap.h"
+#include "stats.h"
+#include "perf_context.h"
 
 namespace fishdb
 {
 
-static const int MAX_PAGE_CACHE = 1000;
+static const int64_t DEFAULT_CACHE_SIZE = 8 << 20;     // bytes
+static const int PREFETCH_GAP = 4;      // pages hinted through to join two runs
+static const int64_t WRITEBACK_BATCH = 16 << 20;   // bytes of page images sorted per write-back
+static const int64_t WRITEBACK_GAP = 4;             // free pages written through to join two runs
+static const int64_t BACKUP_CHUNK = (1 << 20) / PG_SIZE; // pages per backup read
+static const int64_t PENDING_SHARE = 8;     // a checkpoint is due when 1/8 of the file is pending
+static const int64_t PENDING_MIN = 128;     // pages, or this many
+
+enum SyncMode
+{
+    SYNC_OFF = 0,           // no fsync, the header is still written at checkpoints
+    SYNC_CHECKPOINT = 1,    // fsync data, then the header, at every checkpoint
+    SYNC_BATCH = 2,         // and checkpoint after every write call
+};
+
+// page images of one node waiting for WriteRuns
+struct PageRun
+{
+    int64_t page_no;
+    int64_t cnt;
+    std::string image;
+};
+
+// old images of pages the last checkpoint uses, saved to the journal
+// before the pages are overwritten. A directory page lists them
+struct JournalGroup
+{
+    int64_t dir;            // where the directory goes
+    int64_t next;           // where the next one goes
+    int64_t images;         // run the images go to
+    std::vector<int64_t> pages;
+};
+
+// directory entries: the page and the crc32c of its image
+static const int JOURNAL_ENTRIES = (PAGE_CAPA - 16) / 16;
+
+// one pwritev of page runs planned by PlanWrites
+struct WriteCall
+{
+    int64_t page_no;
+    int64_t end;
+    int64_t pages;          // node pages, the rest of the span is zero fill
+    std::vector<struct iovec> iov;
+    // on the first call, saved and synced before any call is issued
+    std::vector<JournalGroup> journal;
+};
+
+// an online backup in progress, see Pager::BeginBackup
+struct BackupState
+{
+    int fd;
+    DBHeader header;            // the snapshot
+    PageBitmap pages;           // pages to copy
+    int64_t cursor;             // pages below it are copied
+    // images of pages overwritten before the copy got to them
+    std::map<int64_t, std::string> saved;
+};
 
 class Pager
 {
 public:
-    int Init(std::string file);
+    int Init(std::string file, int64_t cache_size = DEFAULT_CACHE_SIZE,
+            int key_mode = KEY_BYTES, int sync_mode = SYNC_CHECKPOINT);
     void Close();
+    int Checkpoint();
+    bool CheckpointDue();
 
     std::shared_ptr<MemPage> GetRoot();
     void SetRoot(int64_t root_page);
@@ -26,19 +92,118 @@ public:
     std::shared_ptr<MemPage> NewPage(PageType type = TREE_PAGE);
     std::shared_ptr<MemPage> GetPage(int64_t page_no, bool stick = false);
     void FlushPage(std::shared_ptr<MemPage> mp);
-    void Prune(int size_limit = MAX_PAGE_CACHE, bool force = false);
+    void FreePage(std::shared_ptr<MemPage> mp);
+    void MarkDirty(std::shared_ptr<MemPage> mp);
+    void Prune(int64_t limit, bool force = false, bool flush = true);
+    void Prefetch(std::vector<int64_t> pages);
+
+    // vacuum, see BTree::Vacuum
+    void BeginVacuum();
+    void BeginVacuum(const std::set<int64_t> &live);
+    void EndVacuum();
+    void Truncate();
+    int64_t PageOwner(int64_t page_no);
+    void MovePage(std::shared_ptr<MemPage> mp, int64_t floor);
+    int PageCount(std::shared_ptr<MemPage> mp);
+    void ChainPages(std::shared_ptr<MemPage> mp, std::vector<int64_t> &pages);
+
+    // warm-up, see BTree::WarmupLoop. WarmRead and WarmPage do only I/O
+    // and may run without the tree lock, InstallPage needs it
+    void SaveWarmList(const std::vector<int64_t> &pages);
+    void LoadWarmList(std::vector<int64_t> &pages);
+    int64_t WarmRead(int64_t page_no, int64_t cnt, std::string &buf);
+    std::shared_ptr<MemPage> WarmPage(char *buf, int64_t page_no, int64_t avail);
+    bool InstallPage(std::shared_ptr<MemPage> mp);
+
+    // background write-back, see BTree::FlushLoop. CollectDirty and
+    // PlanWrites need the tree lock, IssueWrites needs m_write_mutex only
+    int64_t CollectDirty(int64_t target, int64_t max_nodes,
+            std::vector<std::shared_ptr<MemPage>> &held, std::vector<PageRun> &runs);
+    void PlanWrites(std::vector<PageRun> &runs, std::vector<WriteCall> &calls);
+    void IssueWrites(std::vector<WriteCall> &calls);
+
+    // online backup, see BTree::Backup. BeginBackup needs the tree lock,
+    // CopyBackup runs without it
+    int BeginBackup(const std::string &path, bool incremental);
+    int CopyBackup();
 
 protected:
-    void FreePage(std::shared_ptr<MemPage> mp);
     void CachePage(std::shared_ptr<MemPage> mp);
-    void WritePage(std::shared_ptr<MemPage> mp);
+    void UncachePage(int64_t page_no);
+    bool Cached(const MemPage *mp);
+    void LruUnlink(MemPage *mp);
+    void LruPushFront(MemPage *mp);
+    void EncodePage(std::shared_ptr<MemPage> mp, std::vector<PageRun> &runs);
+    void WriteRuns(std::vector<PageRun> &runs);
+    void WriteBack(std::vector<std::shared_ptr<MemPage>> &dirty);
+    void SealPages(char *buf, int64_t cnt);
+    void WritePages(int64_t page_no, int64_t cnt, char *buf);
+    void BeforeWrite(int64_t page_no, int64_t end);
+    void PlanJournal(int64_t page_no, int64_t end, std::vector<JournalGroup> &groups);
+    void SaveJournal(std::vector<JournalGroup> &groups);
+    bool Recover();
+    void FreePages(int64_t page_no, int64_t cnt);
+    int64_t FindFresh(int64_t cnt);
+    void ReadPages(int64_t page_no, int64_t cnt, char *buf);
+    bool CheckPage(char *buf, int64_t page_no);
+    std::shared_ptr<MemPage> BadPage(int64_t page_no);
+    void WriteHeader();
+    bool ReadHeader(int fd, int slot, DBHeader &header);
     std::shared_ptr<MemPage> ReadPage(int64_t page_no);
+    int64_t AllocPages(int64_t cnt, int64_t prefer = -1);
+    void LoadBitmap();
+    void SaveBitmap(PageBitmap &saved);
+    int64_t AllocJournal(int64_t cnt);
 
 public:
     std::map<int64_t, std::shared_ptr<MemPage>> m_pages;
+    // guards m_pages, the LRU and m_usage while readers share the tree;
+    // writers hold the tree exclusively and need it only where readers
+    // go: GetPage, Prune and Prefetch
+    std::mutex m_cache_mutex;
+    // most recently used first, Prune evicts from the tail
+    MemPage *m_lru_head;
+    MemPage *m_lru_tail;
+    int64_t m_usage;        // sum of the charges of cached pages
+    int64_t m_capacity;
+    int64_t m_dirty_pages;  // cached pages that are dirty
+    // pages dirtied since the last Prune, their charge is refreshed there
+    std::vector<std::shared_ptr<MemPage>> m_touched;
     DBHeader *m_db_header;
-    FILE *m_file;
-    int64_t m_file_size;
+    int m_sync_mode;
+    bool m_changed;         // MarkDirty since the last checkpoint
+    std::string m_path;
+    int m_fd;
+    // page writes issued without the tree lock are ordered with all
+    // others by this, so a newer image never lands before an older one
+    std::mutex m_write_mutex;
+    std::atomic<int64_t> m_file_size;
+    // under m_write_mutex: the running backup, and the pages written
+    // since the snapshot of the last one, for an incremental backup
+    BackupState *m_backup;
+    PageBitmap m_backup_changed;
+    std::string m_backup_path;
+    int64_t m_backup_seq;       // header seq of the last backup, 0 for none
+    PageBitmap m_bitmap;
+    bool m_bitmap_lost;         // none usable at Init, every page counts as used
+    // a crash goes back to the last checkpoint: the pages it uses
+    // (stable) are journaled before they are first overwritten, and
+    // those freed since, and the journal's own, stay taken until the
+    // next one is on disk (pending)
+    PageBitmap m_stable;
+    PageBitmap m_journaled;
+    PageBitmap m_pending;
+    int64_t m_pending_pages;    // used in m_pending, see CheckpointDue
+    int64_t m_journal_next;     // where the next journal directory goes
+    std::atomic<int64_t> m_corrupt;     // pages that failed their checksum
+    Statistics m_stats;
+    // bumped when a page leaves the cache or is freed, its disk image
+    // may change after that without anyone holding it in memory
+    int64_t m_evict_seq;
+
+    bool m_vacuum;
+    int64_t m_vacuum_frontier;
+    int64_t m_alloc_floor;
 };
 static const std::shared_ptr<MemPage> nil;
 
@@ -0,0 +1,51 @@
+#include <sstream>
+#include "perf_context.h"
+
+namespace fishdb
+{
+
+thread_local PerfLevel perf_level = PERF_DISABLE;
+thread_local PerfContext perf_context;
+
+void PerfContext::Reset()
+{
+    pages_visited = 0;
+    cache_misses = 0;
+    bytes_read = 0;
+    key_comparisons = 0;
+    parse_nanos = 0;
+    read_nanos = 0;
+    write_nanos = 0;
+    evict_nanos = 0;
+}
+
+std::string PerfContext::ToString()
+{
+    std::ostringstream out;
+    out << "pages_visited = " << pages_visited
+        << ", cache_misses = " << cache_misses
+        << ", bytes_read = " << bytes_read
+        << ", key_comparisons = " << key_comparisons
+        << ", parse_nanos = " << parse_nanos
+        << ", read_nanos = " << read_nanos
+        << ", write_nanos = " << write_nanos
+        << ", evict_nanos = " << evict_nanos;
+    return out.str();
+}
+
+void SetPerfLevel(PerfLevel level)
+{
+    perf_level = level;
+}
+
+PerfLevel GetPerfLevel()
+{
+    return perf_level;
+}
+
+PerfContext *GetPerfContext()
+{
+    return &perf_context;
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef PERF_CONTEXT_H_
+#define PERF_CONTEXT_H_
+
+#include <stdint.h>
+#include <string>
+#include <chrono>
+
+namespace fishdb
+{
+
+enum PerfLevel
+{
+    PERF_DISABLE = 0,       // nothing is recorded
+    PERF_COUNT = 1,         // counters only
+    PERF_TIME = 2,          // counters and timers
+};
+
+// what the calling thread's operations cost, reset and read it around
+// the calls you want to look at:
+//     SetPerfLevel(PERF_TIME);
+//     GetPerfContext()->Reset();
+//     bt->Get(key, value);
+//     std::cout << GetPerfContext()->ToString();
+struct PerfContext
+{
+    uint64_t pages_visited;     // nodes fetched below the root, which is always held
+    uint64_t cache_misses;
+    uint64_t bytes_read;
+    uint64_t key_comparisons;
+    uint64_t parse_nanos;       // decoding nodes read from disk
+    uint64_t read_nanos;
+    uint64_t write_nanos;
+    uint64_t evict_nanos;       // flushing pages out of the cache
+
+    void Reset();
+    std::string ToString();
+};
+
+void SetPerfLevel(PerfLevel level);
+PerfLevel GetPerfLevel();
+PerfContext *GetPerfContext();
+
+extern thread_local PerfLevel perf_level;
+extern thread_local PerfContext perf_context;
+
+class PerfTimer
+{
+public:
+    explicit PerfTimer(uint64_t *metric): m_metric(NULL)
+    {
+        if (perf_level >= PERF_TIME)
+        {
+            m_metric = metric;
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+    ~PerfTimer()
+    {
+        if (m_metric)
+            *m_metric += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    uint64_t *m_metric;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// build with -DFISHDB_NPERF to compile the instrumentation out
+#ifdef FISHDB_NPERF
+#define PERF_COUNTER_ADD(metric, n)
+#define PERF_TIMER_GUARD(metric)
+#else
+#define PERF_COUNTER_ADD(metric, n) \
+    do { if (perf_level >= PERF_COUNT) perf_context.metric += (n); } while (0)
+#define PERF_TIMER_GUARD(metric) \
+    PerfTimer perf_timer_##metric(&perf_context.metric)
+#endif
+
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef RWLOCK_H_
+#define RWLOCK_H_
+
+#include <pthread.h>
+
+namespace fishdb
+{
+
+// many readers or one writer. Writers are preferred so a stream of
+// readers cannot starve them, which makes taking a read lock twice on
+// one thread a deadlock. lock/unlock fit std::lock_guard, std::unique_lock
+// and std::condition_variable_any
+class RWLock
+{
+public:
+    RWLock()
+    {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&m_lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+    ~RWLock() { pthread_rwlock_destroy(&m_lock); }
+
+    void lock() { pthread_rwlock_wrlock(&m_lock); }
+    void unlock() { pthread_rwlock_unlock(&m_lock); }
+    void lock_shared() { pthread_rwlock_rdlock(&m_lock); }
+    void unlock_shared() { pthread_rwlock_unlock(&m_lock); }
+
+private:
+    RWLock(const RWLock &);
+    RWLock &operator=(const RWLock &);
+
+    pthread_rwlock_t m_lock;
+};
+
+class ReadGuard
+{
+public:
+    explicit ReadGuard(RWLock &lock): m_lock(lock) { m_lock.lock_shared(); }
+    ~ReadGuard() { m_lock.unlock_shared(); }
+
+private:
+    RWLock &m_lock;
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#include <sstream>
+#include "stats.h"
+
+namespace fishdb
+{
+
+static const char *ticker_names[TICKER_MAX] =
+{
+    "fishdb.cache.hit",
+    "fishdb.cache.miss",
+    "fishdb.cache.evictions",
+    "fishdb.pages.read",
+    "fishdb.pages.written",
+    "fishdb.bytes.read",
+    "fishdb.bytes.written",
+    "fishdb.write.calls",
+    "fishdb.flusher.nodes",
+    "fishdb.checkpoints",
+    "fishdb.journal.pages",
+    "fishdb.backup.pages",
+    "fishdb.backup.saved.pages",
+    "fishdb.overflow.nodes.read",
+    "fishdb.overflow.pages.read",
+    "fishdb.node.splits",
+    "fishdb.node.append.splits",
+    "fishdb.node.merges",
+    "fishdb.node.rotations",
+    "fishdb.corrupt.pages",
+};
+
+Statistics::Statistics()
+{
+    Reset();
+}
+
+int Statistics::Shard()
+{
+    static std::atomic<int> next(0);
+    static thread_local int shard = next.fetch_add(1, std::memory_order_relaxed) % STATS_SHARDS;
+    return shard;
+}
+
+uint64_t Statistics::Get(Ticker ticker)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < STATS_SHARDS; ++i)
+        sum += m_shards[i].count[ticker].load(std::memory_order_relaxed);
+    return sum;
+}
+
+void Statistics::Reset()
+{
+    for (int i = 0; i < STATS_SHARDS; ++i)
+    {
+        for (int t = 0; t < TICKER_MAX; ++t)
+            m_shards[i].count[t].store(0, std::memory_order_relaxed);
+    }
+}
+
+std::string Statistics::ToString()
+{
+    std::ostringstream out;
+    for (int t = 0; t < TICKER_MAX; ++t)
+        out << ticker_names[t] << ": " << Get((Ticker)t) << "\n";
+    return out.str();
+}
+
+const char *Statistics::Name(Ticker ticker)
+{
+    return ticker_names[ticker];
+}
+
+}
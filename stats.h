@@ -0,0 +1,69 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+
+namespace fishdb
+{
+
+enum Ticker
+{
+    CACHE_HIT = 0,
+    CACHE_MISS,
+    CACHE_EVICTIONS,
+    PAGES_READ,
+    PAGES_WRITTEN,
+    BYTES_READ,
+    BYTES_WRITTEN,
+    WRITE_CALLS,            // pwrite/pwritev calls, pages written over this is the run length
+    FLUSHER_NODES,          // nodes written back ahead of eviction by the flusher thread
+    CHECKPOINTS,
+    JOURNAL_PAGES,          // old images saved before their page is first rewritten after a checkpoint
+    BACKUP_PAGES,           // pages copied by Backup
+    BACKUP_SAVED_PAGES,     // old images kept for a running backup before a write
+    OVERFLOW_NODES_READ,    // nodes read that span more than one page
+    OVERFLOW_PAGES_READ,    // their extra pages, over the above is the chain length
+    NODE_SPLITS,
+    NODE_APPEND_SPLITS,     // of those, splits of the rightmost node that leave the left one full
+    NODE_MERGES,
+    NODE_ROTATIONS,
+    CORRUPT_PAGES,
+    TICKER_MAX,
+};
+
+static const int STATS_SHARDS = 16;
+
+// event counters. Each thread bumps its own shard with relaxed atomics,
+// a read sums the shards, so counting never contends
+class Statistics
+{
+public:
+    Statistics();
+
+    void Add(Ticker ticker, uint64_t n = 1)
+    {
+        m_shards[Shard()].count[ticker].fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t Get(Ticker ticker);
+    void Reset();
+    std::string ToString();
+
+    static const char *Name(Ticker ticker);
+
+private:
+    static int Shard();
+
+    // padded so two shards never share a cache line
+    struct Counters
+    {
+        std::atomic<uint64_t> count[TICKER_MAX];
+        char pad[64];
+    };
+    Counters m_shards[STATS_SHARDS];
+};
+
+}
+
+#endif
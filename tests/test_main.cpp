@@ -3,6 +3,9 @@
 #include <iostream>
 #include <sstream>
 #include <time.h>
+#include <set>
+#include <thread>
+#include <atomic>
 #include "minunit.h"
 #include "btree.h"
 
@@ -17,7 +20,7 @@ void FillPage(std::shared_ptr<MemPage> mp)
     for (int i = 0; i < ks; ++i)
         mp->children.push_back(100);
     for (int i = 0; i < ks; ++i)
-        mp->kvs.push_back(KV("hello", "world"));
+        mp->InsertKV(mp->kvs.size(), "hello", "world");
 }
 
 MU_TEST(test_encode)
@@ -127,9 +130,1556 @@ MU_TEST(test_btree_simple)
     delete bt;
 }
 
+std::string NumKey(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key%05d", i);
+    return buf;
+}
+
+MU_TEST(test_node_entries)
+{
+    MemPage mp;
+    memset(&mp.header, 0, sizeof(PageHeader));
+    mp.is_leaf = true;
+    std::map<std::string, std::string> expect;
+    for (int i = 0; i < 64; ++i)
+    {
+        std::string key = NumKey(i * 2);
+        mp.InsertKV(i, key, "v" + std::to_string(i));
+        expect[key] = "v" + std::to_string(i);
+    }
+    // overwrites grow and shrink values, erases leave dead bytes to pack
+    for (int i = 0; i < 64; i += 2)
+    {
+        std::string value(i * 3, 'x');
+        mp.SetValue(i, value);
+        expect[NumKey(i * 2)] = value;
+    }
+    for (int i = 63; i >= 0; i -= 3)
+    {
+        expect.erase(mp.kvs.Key(i).ToString());
+        mp.kvs.Erase(i, i + 1);
+    }
+    // entries copied from the node itself, the buffer may move under them
+    for (int i = 0; i < 20; i += 2)
+    {
+        std::string key = mp.kvs.Key(i).ToString() + "a";
+        expect[key] = mp.kvs.Value(i).ToString();
+        mp.InsertKV(i + 1, key, mp.kvs.Value(i));
+    }
+    mp.SetKV(0, mp.kvs.Key(0), mp.kvs.Value(1));
+    expect[mp.kvs.Key(0).ToString()] = mp.kvs.Value(1).ToString();
+
+    mu_check(mp.kvs.size() == expect.size());
+    size_t i = 0;
+    for (auto it = expect.begin(); it != expect.end(); ++it, ++i)
+        mu_check(mp.kvs.Key(i) == it->first && mp.kvs.Value(i) == it->second);
+
+    // a decoded node takes over its image, trimmed of page padding
+    std::vector<char> buf(1 << 16);
+    int size = 0;
+    mp.Serialize(&buf[0], size);
+    MemPage copy;
+    copy.header = mp.header;
+    copy.Feed(&buf[PH_SIZE], PAGE_CAPA * ((size - PH_SIZE) / PAGE_CAPA + 1));
+    copy.Parse();
+    mu_check(copy.kvs.size() == expect.size());
+    mu_check(copy.kvs.Footprint() < size + (int64_t)expect.size() * 16 + size / 8);
+    i = 0;
+    for (auto it = expect.begin(); it != expect.end(); ++it, ++i)
+        mu_check(copy.kvs.Key(i) == it->first && copy.kvs.Value(i) == it->second);
+
+    // with the image size in the header, feeding stops at the image end
+    MemPage sized;
+    sized.header = mp.header;
+    sized.header.type = TREE_PAGE;
+    sized.header.data_size = size - PH_SIZE;
+    sized.header.page_cnt = (size - PH_SIZE + PAGE_CAPA - 1) / PAGE_CAPA;
+    for (int off = PH_SIZE; off < size; off += PAGE_CAPA)
+        sized.Feed(&buf[off], PAGE_CAPA);
+    mu_check((int)sized.data.size() == size - PH_SIZE);
+    sized.Parse();
+    mu_check(sized.kvs.size() == expect.size());
+    mu_check(sized.kvs.Key(sized.kvs.size() - 1) == expect.rbegin()->first);
+}
+
+MU_TEST(test_iter_reverse)
+{
+    remove("test4.fdb");
+    bt = BTree::Open("test4.fdb");
+    mu_check(bt != NULL);
+
+    int N = 300;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i * 2), val);
+    }
+
+    auto iter = bt->NewIterator();
+    int n = N;
+    for (iter->SeekToLast(); iter->Valid(); iter->Prev())
+    {
+        --n;
+        mu_check(iter->Key() == NumKey(n * 2));
+    }
+    mu_check(n == 0);
+
+    // SeekForPrev lands on the last key <= target
+    iter->SeekForPrev(NumKey(101).c_str());
+    mu_check(iter->Valid() && iter->Key() == NumKey(100));
+    iter->SeekForPrev(NumKey(100).c_str());
+    mu_check(iter->Valid() && iter->Key() == NumKey(100));
+    iter->SeekForPrev("a");
+    mu_check(!iter->Valid());
+    iter->SeekForPrev("z");
+    mu_check(iter->Valid() && iter->Key() == NumKey((N - 1) * 2));
+
+    // Seek lands on the first key >= target
+    iter->Seek(NumKey(101).c_str());
+    mu_check(iter->Valid() && iter->Key() == NumKey(102));
+    iter->Seek("z");
+    mu_check(!iter->Valid());
+
+    // walking back and forth from the middle
+    n = 0;
+    for (iter->SeekForPrev(NumKey(401).c_str()); iter->Valid() && n < 50; iter->Prev())
+        ++n;
+    mu_check(iter->Valid() && iter->Key() == NumKey(300));
+    for (int i = 0; i < 50; ++i)
+        iter->Next();
+    mu_check(iter->Valid() && iter->Key() == NumKey(400));
+
+    delete iter;
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_delete_range)
+{
+    remove("test5.fdb");
+    bt = BTree::Open("test5.fdb");
+    mu_check(bt != NULL);
+
+    int N = 2000;
+    std::string big_val(2000, 'v');
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = (i % 7 == 0) ? big_val : NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+
+    bt->DeleteRange(NumKey(300), NumKey(1500));
+    bt->DeleteRange(NumKey(1990), "z");
+    bt->DeleteRange(NumKey(10), NumKey(10));
+
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        int ret = bt->Get(NumKey(i), v);
+        if ((i >= 300 && i < 1500) || i >= 1990)
+            mu_check(ret == BT_NOT_FOUND);
+        else
+            mu_check(ret == BT_OK);
+    }
+    auto iter = bt->NewIterator();
+    int n = 0;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next())
+        ++n;
+    mu_check(n == N - 1200 - 10);
+    delete iter;
+    bt->Close();
+    delete bt;
+
+    // freed pages are reused and the new root survives reopen
+    bt = BTree::Open("test5.fdb");
+    for (int i = 300; i < 1500; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+    bt->DeleteRange("a", "z");
+    iter = bt->NewIterator();
+    iter->SeekToFirst();
+    mu_check(!iter->Valid());
+    delete iter;
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_order_statistic)
+{
+    remove("test6.fdb");
+    bt = BTree::Open("test6.fdb");
+    mu_check(bt != NULL);
+
+    std::set<std::string> model;
+    for (int i = 0; i < 3000; ++i)
+    {
+        std::string key = NumKey(rand() % 5000);
+        if (rand() % 4 == 0)
+        {
+            bt->Del(key);
+            model.erase(key);
+        }
+        else
+        {
+            bt->Put(key, key);
+            model.insert(key);
+        }
+    }
+    bt->DeleteRange(NumKey(1000), NumKey(1700));
+    model.erase(model.lower_bound(NumKey(1000)), model.lower_bound(NumKey(1700)));
+    bt->Close();
+    delete bt;
+
+    bt = BTree::Open("test6.fdb");
+    mu_check(bt->Count() == (int64_t)model.size());
+    int64_t k = 0;
+    for (auto iter = model.begin(); iter != model.end(); ++iter, ++k)
+    {
+        std::string key, val;
+        mu_check(bt->Rank(*iter) == k);
+        mu_check(bt->Select(k, key, val) == BT_OK && key == *iter);
+    }
+    std::string key, val;
+    mu_check(bt->Select(k, key, val) == BT_NOT_FOUND);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        std::string a = NumKey(rand() % 5000);
+        std::string b = NumKey(rand() % 5000);
+        int64_t expect = 0;
+        if (a < b)
+            expect = std::distance(model.lower_bound(a), model.lower_bound(b));
+        mu_check(bt->CountRange(a, b) == expect);
+        int64_t approx = bt->ApproximateSize(a, b);
+        mu_check(approx >= expect - 2 * BT_DEFAULT_KEY_NUM * 2 &&
+                approx <= expect + 2 * BT_DEFAULT_KEY_NUM * 2);
+    }
+    bt->Close();
+    delete bt;
+}
+
+long FileSize(const char *fname)
+{
+    FILE *fp = fopen(fname, "rb");
+    if (fp == NULL) return -1;
+    fseek(fp, 0L, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+std::string VacuumVal(int i)
+{
+    return (i % 3 == 0) ? std::string(1500, 'a' + i % 26) : NumKey(i);
+}
+
+// damage the saved allocation bitmap, Open then takes every page as used
+void DamageBitmap(const char *file)
+{
+    FILE *fp = fopen(file, "rb+");
+    char buf[PG_SIZE];
+    for (long off = PG_SIZE; ; off += PG_SIZE)
+    {
+        fseek(fp, off, SEEK_SET);
+        if (fread(buf, 1, PG_SIZE, fp) != PG_SIZE) break;
+        PageHeader header;
+        memcpy(&header, buf, PH_SIZE);
+        if (header.type != META_PAGE) continue;
+        buf[PH_SIZE] ^= 0x5a;
+        fseek(fp, off, SEEK_SET);
+        fwrite(buf, 1, PG_SIZE, fp);
+    }
+    fclose(fp);
+}
+
+MU_TEST(test_vacuum)
+{
+    remove("test7.fdb");
+    bt = BTree::Open("test7.fdb");
+    mu_check(bt != NULL);
+
+    int N = 3000;
+    std::set<int> live;
+    for (int i = 0; i < N; ++i)
+    {
+        int k = rand() % N;
+        std::string val = VacuumVal(k);
+        bt->Put(NumKey(k), val);
+        live.insert(k);
+    }
+    bt->Close();
+    delete bt;
+
+    // shrinking values after a flush leaves free pages all over the file
+    bt = BTree::Open("test7.fdb");
+    for (int i = 0; i < N; ++i)
+    {
+        int k = rand() % N;
+        if (k % 4 == 0) continue;
+        bt->Del(NumKey(k));
+        live.erase(k);
+    }
+    bt->Close();
+    delete bt;
+    long before = FileSize("test7.fdb");
+
+    bt = BTree::Open("test7.fdb");
+    int steps = 0;
+    while (bt->Vacuum(16) == BT_INCOMPLETE)
+        ++steps;
+    mu_check(steps > 1);
+    bt->Close();
+    delete bt;
+    long after = FileSize("test7.fdb");
+    mu_check(after < before);
+
+    // concurrent writes while vacuuming in background
+    bt = BTree::Open("test7.fdb");
+    bt->StartVacuum(4, 1);
+    for (int i = 0; i < 500; ++i)
+    {
+        int k = rand() % N;
+        if (i % 2)
+        {
+            std::string val = VacuumVal(k);
+            bt->Put(NumKey(k), val);
+            live.insert(k);
+        }
+        else
+        {
+            bt->Del(NumKey(k));
+            live.erase(k);
+        }
+    }
+    bt->Close();
+    delete bt;
+
+    // with the bitmap lost every page counts as used until a vacuum
+    // finds the live ones from the root
+    bt = BTree::Open("test7.fdb");
+    for (int k = 0; k < N; k += 3)
+    {
+        bt->Del(NumKey(k));
+        live.erase(k);
+    }
+    bt->Close();
+    delete bt;
+    DamageBitmap("test7.fdb");
+    before = FileSize("test7.fdb");
+    bt = BTree::Open("test7.fdb");
+    while (bt->Vacuum(16) == BT_INCOMPLETE)
+        ;
+    bt->Close();
+    delete bt;
+    mu_check(FileSize("test7.fdb") < before);
+
+    bt = BTree::Open("test7.fdb");
+    mu_check(bt->Count() == (int64_t)live.size());
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        int ret = bt->Get(NumKey(i), v);
+        if (live.count(i))
+            mu_check(ret == BT_OK && v == VacuumVal(i));
+        else
+            mu_check(ret == BT_NOT_FOUND);
+    }
+    bt->Close();
+    delete bt;
+    // nodes far bigger than a page are encoded and moved as well
+    remove("test7.fdb");
+    remove("test7.fdb.warm");
+    bt = BTree::Open("test7.fdb", DefaultCmp(), 2);
+    for (int i = 0; i < 40; ++i)
+    {
+        std::string v(20000 + i, 'a' + i % 26);
+        bt->Put(NumKey(i), v);
+    }
+    for (int i = 0; i < 40; i += 2)
+        bt->Del(NumKey(i));
+    while (bt->Vacuum(16) == BT_INCOMPLETE)
+        ;
+    for (int i = 1; i < 40; i += 2)
+    {
+        std::string v;
+        mu_check(bt->Get(NumKey(i), v) == BT_OK && v == std::string(20000 + i, 'a' + i % 26));
+    }
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_extent_alloc)
+{
+    PageBitmap bm;
+    bm.Reset(1);
+    bm.Set(0);
+    bm.Set(1, 3);
+    bm.Set(6);
+    mu_check(bm.FindRun(1, 1) == 4);
+    mu_check(bm.FindRun(2, 1) == 4);
+    mu_check(bm.FindRun(3, 1) == 7);
+    bm.Clear(2);
+    mu_check(bm.FindRun(1, 1) == 2);
+    mu_check(bm.FreeCount() == 3);
+    mu_check(bm.LastUsed() == 6);
+
+    // multi-page nodes survive reopen and freed extents get reused
+    remove("test8.fdb");
+    bt = BTree::Open("test8.fdb");
+    mu_check(bt != NULL);
+    int N = 400;
+    // scrambled, so nodes start half full as they would under random
+    // inserts rather than packed by append splits
+    for (int j = 0; j < N; ++j)
+    {
+        int i = j * 7 % N;
+        std::string val(1200, 'a' + i % 26);
+        bt->Put(NumKey(i), val);
+    }
+    bt->Close();
+    delete bt;
+    long before = FileSize("test8.fdb");
+
+    bt = BTree::Open("test8.fdb");
+    for (int i = 0; i < N; i += 2)
+        bt->Del(NumKey(i));
+    bt->Close();
+    delete bt;
+
+    // pages freed since a checkpoint are reused after the next one, a
+    // crash may go back to the last one until then
+    bt = BTree::Open("test8.fdb");
+    for (int i = 0; i < N; i += 2)
+    {
+        std::string val(1200, 'A' + i % 26);
+        bt->Put(NumKey(i), val);
+        if (i % 40 == 0)
+            bt->Checkpoint();
+    }
+    bt->Close();
+    delete bt;
+    mu_check(FileSize("test8.fdb") < before * 5 / 4);
+
+    bt = BTree::Open("test8.fdb");
+    mu_check(bt->Count() == N);
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        mu_check(bt->Get(NumKey(i), v) == BT_OK);
+        mu_check(v == std::string(1200, ((i % 2) ? 'a' : 'A') + i % 26));
+    }
+    bt->Close();
+    delete bt;
+}
+
+void FlipByte(const char *file, long offset)
+{
+    FILE *fp = fopen(file, "rb+");
+    fseek(fp, offset, SEEK_SET);
+    int c = fgetc(fp);
+    fseek(fp, offset, SEEK_SET);
+    fputc(c ^ 0x5a, fp);
+    fclose(fp);
+}
+
+MU_TEST(test_checksum)
+{
+    const char *digits = "123456789";
+    mu_check(Crc32c(digits, 9) == 0xe3069283);
+    mu_check(Crc32cPortable(digits, 9) == 0xe3069283);
+    std::string big(1000, 'x');
+    mu_check(Crc32c(big.data(), big.size()) == Crc32cPortable(big.data(), big.size()));
+
+    remove("test9.fdb");
+    bt = BTree::Open("test9.fdb");
+    mu_check(bt != NULL);
+    int N = 500;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+    bt->Close();
+    delete bt;
+
+    // damage one tree page, reads through it report corruption
+    FlipByte("test9.fdb", PG_SIZE * 1 + PH_SIZE + 10);
+    bt = BTree::Open("test9.fdb");
+    mu_check(bt != NULL);
+    int bad = 0;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        int ret = bt->Get(NumKey(i), v);
+        if (ret == BT_CORRUPTION)
+            bad++;
+        else
+            mu_check(ret == BT_OK && v == NumKey(i));
+    }
+    mu_check(bad > 0);
+    std::string val = "v";
+    mu_check(bt->Put("new", val) == BT_CORRUPTION);
+    bt->Close();
+    delete bt;
+
+    // a header damaged in both slots refuses to open
+    for (int slot = 0; slot < HEADER_SLOTS; ++slot)
+        FlipByte("test9.fdb", slot * (PG_SIZE / HEADER_SLOTS) + 20);
+    mu_check(BTree::Open("test9.fdb") == NULL);
+}
+
+MU_TEST(test_warmup)
+{
+    remove("test10.fdb");
+    remove("test10.fdb.warm");
+    bt = BTree::Open("test10.fdb");
+    mu_check(bt != NULL);
+    int N = 2000;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+    bt->Close();
+    delete bt;
+    mu_check(FileSize("test10.fdb.warm") > (long)sizeof(WarmHeader));
+
+    bt = BTree::Open("test10.fdb");
+    bt->WaitWarmup();
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        mu_check(bt->Get(NumKey(i), v) == BT_OK && v == NumKey(i));
+    }
+    bt->Close();
+    delete bt;
+
+    // writes racing the warm-up
+    std::set<int> live;
+    for (int i = 0; i < N; ++i)
+        live.insert(i);
+    bt = BTree::Open("test10.fdb");
+    for (int i = 0; i < N; ++i)
+    {
+        int k = rand() % (N * 2);
+        if (k % 3 == 0)
+        {
+            bt->Del(NumKey(k));
+            live.erase(k);
+        }
+        else
+        {
+            std::string val = NumKey(k);
+            bt->Put(NumKey(k), val);
+            live.insert(k);
+        }
+    }
+    bt->Close();
+    delete bt;
+
+    bt = BTree::Open("test10.fdb");
+    bt->WaitWarmup();
+    mu_check(bt->Count() == (int64_t)live.size());
+    for (int i = 0; i < N * 2; ++i)
+    {
+        std::string v;
+        int ret = bt->Get(NumKey(i), v);
+        if (live.count(i))
+            mu_check(ret == BT_OK && v == NumKey(i));
+        else
+            mu_check(ret == BT_NOT_FOUND);
+    }
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_properties)
+{
+    remove("test11.fdb");
+    bt = BTree::Open("test11.fdb");
+    mu_check(bt != NULL);
+    int N = 1000;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+    for (int i = 0; i < N; i += 2)
+        bt->Del(NumKey(i));
+    // half empty nodes are left alone, a drained range is merged
+    for (int i = 1; i < N / 5; i += 2)
+        bt->Del(NumKey(i));
+
+    int64_t num = 0;
+    mu_check(bt->GetProperty("fishdb.num-entries", num) == BT_OK && num == N / 2 - N / 10);
+    mu_check(bt->GetProperty("fishdb.tree-height", num) == BT_OK && num > 1);
+    mu_check(bt->GetProperty("fishdb.node.splits", num) == BT_OK && num > 0);
+    mu_check(bt->GetProperty("fishdb.node.merges", num) == BT_OK && num > 0);
+    mu_check(bt->GetProperty("fishdb.cache-usage", num) == BT_OK && num > 0);
+    mu_check(bt->GetProperty("fishdb.no-such-thing", num) == BT_NOT_FOUND);
+    bt->Close();
+    delete bt;
+
+    bt = BTree::Open("test11.fdb");
+    bt->WaitWarmup();
+    std::string v;
+    for (int i = 1; i < N; i += 2)
+        bt->Get(NumKey(i), v);
+    mu_check(bt->GetProperty("fishdb.cache.hit", num) == BT_OK && num > 0);
+    mu_check(bt->GetProperty("fishdb.pages.read", num) == BT_OK && num > 0);
+    mu_check(bt->GetProperty("fishdb.file-size", num) == BT_OK && num == FileSize("test11.fdb"));
+    std::string stats;
+    mu_check(bt->GetProperty("fishdb.stats", stats) == BT_OK);
+    mu_check(stats.find("fishdb.cache.miss: ") != std::string::npos);
+    mu_check(stats.find("fishdb.free-pages: ") != std::string::npos);
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_perf_context)
+{
+    remove("test12.fdb");
+    bt = BTree::Open("test12.fdb");
+    mu_check(bt != NULL);
+    int N = 1000;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+    bt->Close();
+    delete bt;
+    remove("test12.fdb.warm");
+
+    bt = BTree::Open("test12.fdb");
+    std::string v;
+    PerfContext *ctx = GetPerfContext();
+    SetPerfLevel(PERF_DISABLE);
+    ctx->Reset();
+    bt->Get(NumKey(1), v);
+    mu_check(ctx->pages_visited == 0 && ctx->key_comparisons == 0);
+
+    SetPerfLevel(PERF_TIME);
+    ctx->Reset();
+    mu_check(bt->Get(NumKey(N - 1), v) == BT_OK);
+    mu_check(ctx->pages_visited > 0);
+    mu_check(ctx->cache_misses > 0);
+    mu_check(ctx->bytes_read >= (uint64_t)PG_SIZE);
+    mu_check(ctx->key_comparisons > 0);
+    mu_check(ctx->read_nanos > 0);
+
+    // a second lookup finds everything cached
+    ctx->Reset();
+    bt->Get(NumKey(N - 1), v);
+    mu_check(ctx->pages_visited > 0 && ctx->cache_misses == 0 && ctx->bytes_read == 0);
+    SetPerfLevel(PERF_DISABLE);
+    bt->Close();
+    delete bt;
+}
+
+std::string SizedVal(int i)
+{
+    return std::string((i * 7919) % 1500, 'a' + i % 26);
+}
+
+MU_TEST(test_cache_budget)
+{
+    remove("test13.fdb");
+    remove("test13.fdb.warm");
+    Options options;
+    options.cache_size = 64 << 10;
+    bt = BTree::Open("test13.fdb", options);
+    mu_check(bt != NULL);
+
+    int N = 4000;
+    std::set<int> live;
+    for (int i = 0; i < N; ++i)
+    {
+        int k = rand() % N;
+        std::string val = SizedVal(k);
+        bt->Put(NumKey(k), val);
+        live.insert(k);
+        if (i % 3 == 0)
+        {
+            k = rand() % N;
+            bt->Del(NumKey(k));
+            live.erase(k);
+        }
+    }
+    int64_t usage = 0, evictions = 0;
+    mu_check(bt->GetProperty("fishdb.cache-usage", usage) == BT_OK);
+    mu_check(usage <= options.cache_size);
+    mu_check(bt->GetProperty("fishdb.cache.evictions", evictions) == BT_OK && evictions > 0);
+
+    // evicted nodes come back intact, a scan sees every key in order
+    Iterator *iter = bt->NewIterator();
+    auto expect = live.begin();
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next(), ++expect)
+    {
+        mu_check(expect != live.end() && iter->Key() == NumKey(*expect));
+        mu_check(iter->Value() == SizedVal(*expect));
+    }
+    mu_check(expect == live.end());
+    delete iter;
+    while (bt->Vacuum(16) == BT_INCOMPLETE)
+        ;
+    bt->Close();
+    delete bt;
+
+    bt = BTree::Open("test13.fdb", options);
+    mu_check(bt->Count() == (int64_t)live.size());
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        int ret = bt->Get(NumKey(i), v);
+        if (live.count(i))
+            mu_check(ret == BT_OK && v == SizedVal(i));
+        else
+            mu_check(ret == BT_NOT_FOUND);
+    }
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_comparator)
+{
+    // bytewise: the empty key and prefixes sort first
+    remove("test14.fdb");
+    bt = BTree::Open("test14.fdb");
+    mu_check(bt != NULL);
+    const char *keys[] = {"b", "", "ab", "a", "abc", "ba"};
+    for (int i = 0; i < 6; ++i)
+    {
+        std::string val = std::string(keys[i]) + "!";
+        bt->Put(keys[i], val);
+    }
+    std::string v;
+    mu_check(bt->Get("", v) == BT_OK && v == "!");
+    mu_check(bt->Get("ab", v) == BT_OK && v == "ab!");
+    const char *order[] = {"", "a", "ab", "abc", "b", "ba"};
+    Iterator *iter = bt->NewIterator();
+    int n = 0;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next(), ++n)
+        mu_check(n < 6 && iter->Key() == order[n]);
+    mu_check(n == 6);
+    delete iter;
+    bt->Close();
+    delete bt;
+
+    // a user comparator still goes through CmpFunc
+    remove("test15.fdb");
+    bt = BTree::Open("test15.fdb", std::greater<std::string>(), 8);
+    mu_check(bt != NULL);
+    int N = 500;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey((i * 37) % N), val);
+    }
+    for (int i = 0; i < N; ++i)
+        mu_check(bt->Get(NumKey((i * 37) % N), v) == BT_OK && v == NumKey(i));
+    iter = bt->NewIterator();
+    n = N;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next())
+        mu_check(iter->Key() == NumKey(--n));
+    mu_check(n == 0);
+    delete iter;
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_u64_keys)
+{
+    remove("test16.fdb");
+    remove("test16.fdb.warm");
+    Options options;
+    options.key_mode = KEY_U64;
+    options.min_key_num = 16;
+    bt = BTree::Open("test16.fdb", options);
+    mu_check(bt != NULL);
+
+    // ids with zero bytes and the extremes, in scrambled order
+    std::set<uint64_t> ids;
+    ids.insert(0);
+    ids.insert(UINT64_MAX);
+    for (uint64_t i = 1; i < 3000; ++i)
+        ids.insert((i * 0x9E3779B97F4A7C15ULL) >> (i % 48));
+    for (auto it = ids.begin(); it != ids.end(); ++it)
+    {
+        std::string val = std::to_string(*it);
+        mu_check(bt->Put(EncodeU64Key(*it), val) == BT_OK);
+    }
+    std::string bad = "abc";
+    mu_check(bt->Put("abc", bad) == BT_ERROR);
+    mu_check(DecodeU64Key(EncodeU64Key(0x0102030405060708ULL)) == 0x0102030405060708ULL);
+
+    // every other id goes away
+    int n = 0;
+    std::set<uint64_t> live;
+    for (auto it = ids.begin(); it != ids.end(); ++it, ++n)
+    {
+        if (n % 2)
+            mu_check(bt->Del(EncodeU64Key(*it)) == BT_OK);
+        else
+            live.insert(*it);
+    }
+    bt->Close();
+    delete bt;
+
+    mu_check(BTree::Open("test16.fdb") == NULL);
+    bt = BTree::Open("test16.fdb", options);
+    mu_check(bt != NULL);
+    std::string v;
+    for (auto it = ids.begin(); it != ids.end(); ++it)
+    {
+        int ret = bt->Get(EncodeU64Key(*it), v);
+        if (live.count(*it))
+            mu_check(ret == BT_OK && v == std::to_string(*it));
+        else
+            mu_check(ret == BT_NOT_FOUND);
+    }
+
+    // keys come back in numeric order
+    Iterator *iter = bt->NewIterator();
+    auto expect = live.begin();
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next(), ++expect)
+        mu_check(expect != live.end() && DecodeU64Key(iter->Key()) == *expect);
+    mu_check(expect == live.end());
+    expect = live.upper_bound(1ULL << 40);
+    iter->Seek(EncodeU64Key((1ULL << 40) + 1));
+    mu_check(iter->Valid() && DecodeU64Key(iter->Key()) == *expect);
+    delete iter;
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_parallel_scan)
+{
+    remove("test17.fdb");
+    remove("test17.fdb.warm");
+    Options options;
+    options.min_key_num = 4;
+    options.cache_size = 256 << 10;
+    bt = BTree::Open("test17.fdb", options);
+    mu_check(bt != NULL);
+    int N = 5000;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+
+    // every key once, while a writer adds keys past the range
+    std::mutex mu;
+    std::multiset<std::string> seen;
+    std::thread writer([]()
+    {
+        for (int i = 0; i < 2000; ++i)
+        {
+            std::string val = "w";
+            bt->Put("zz" + NumKey(i), val);
+        }
+    });
+    int ret = bt->ParallelScan("", NumKey(N), 4, [&](const std::string &k, const std::string &v)
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        seen.insert(k);
+        return k == v;
+    });
+    writer.join();
+    mu_check(ret == BT_OK);
+    mu_check((int)seen.size() == N);
+    int n = 0;
+    for (auto it = seen.begin(); it != seen.end(); ++it, ++n)
+        mu_check(*it == NumKey(n));
+
+    // a middle range, the open end, and stopping early
+    std::atomic<int> cnt(0);
+    bt->ParallelScan(NumKey(1000), NumKey(2000), 3, [&](const std::string &k, const std::string &v)
+    {
+        cnt++;
+        return NumKey(1000) <= k && k < NumKey(2000);
+    });
+    mu_check(cnt == 1000);
+    cnt = 0;
+    bt->ParallelScan(NumKey(N - 10), "", 2, [&](const std::string &k, const std::string &v)
+    {
+        cnt++;
+        return true;
+    });
+    mu_check(cnt == 10 + 2000);
+    cnt = 0;
+    bt->ParallelScan("", "", 4, [&](const std::string &k, const std::string &v)
+    {
+        return ++cnt < 10;
+    });
+    mu_check(cnt >= 10 && cnt < 100);
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_writeback)
+{
+    remove("test18.fdb");
+    Pager pager;
+    mu_check(pager.Init("test18.fdb") == 0);
+
+    // fresh pages are adjacent, written back as one run
+    int N = 64;
+    std::vector<int64_t> pgno;
+    for (int i = 0; i < N; ++i)
+    {
+        auto mp = pager.NewPage();
+        mp->InsertKV(0, KV(NumKey(i), "v"));
+        pgno.push_back(mp->header.page_no);
+    }
+    uint64_t calls = pager.m_stats.Get(WRITE_CALLS);
+    uint64_t pages = pager.m_stats.Get(PAGES_WRITTEN);
+    pager.Prune(0, true);
+    mu_check(pager.m_stats.Get(WRITE_CALLS) - calls == 1);
+    mu_check(pager.m_stats.Get(PAGES_WRITTEN) - pages == (uint64_t)N);
+
+    // every other page, in reverse: sorted, one call per page
+    for (int i = N - 1; i >= 0; i -= 2)
+    {
+        auto mp = pager.GetPage(pgno[i]);
+        mp->SetKV(0, KV(NumKey(i), "w"));
+        pager.MarkDirty(mp);
+    }
+    calls = pager.m_stats.Get(WRITE_CALLS);
+    pager.Prune(0, true);
+    mu_check(pager.m_stats.Get(WRITE_CALLS) - calls == (uint64_t)N / 2);
+    for (int i = 0; i < N; ++i)
+    {
+        auto mp = pager.GetPage(pgno[i]);
+        mu_check(mp->kvs.size() == 1 && mp->kvs.Key(0) == NumKey(i));
+        mu_check(mp->kvs.Value(0) == ((i % 2) ? "w" : "v"));
+    }
+    pager.Close();
+}
+
+MU_TEST(test_flusher)
+{
+    remove("test19.fdb");
+    remove("test19.fdb.warm");
+    Options options;
+    options.cache_size = 256 << 10;
+    options.dirty_ratio = 0.1;
+    bt = BTree::Open("test19.fdb", options);
+    mu_check(bt != NULL);
+
+    // the flusher writes nodes back while writers and vacuum go on
+    bt->StartVacuum(8, 1);
+    int N = 6000;
+    std::set<int> live;
+    for (int i = 0; i < N; ++i)
+    {
+        int k = rand() % N;
+        std::string val = SizedVal(k);
+        bt->Put(NumKey(k), val);
+        live.insert(k);
+        if (i % 4 == 0)
+        {
+            k = rand() % N;
+            bt->Del(NumKey(k));
+            live.erase(k);
+        }
+    }
+    bt->StopVacuum();
+
+    // once writers pause it brings the dirty share under the ratio
+    int64_t dirty = 0, pages = 0, flushed = 0;
+    for (int i = 0; i < 200; ++i)
+    {
+        bt->GetProperty("fishdb.cache-dirty-pages", dirty);
+        bt->GetProperty("fishdb.cache-pages", pages);
+        if (dirty <= pages * options.dirty_ratio) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    mu_check(dirty <= pages * options.dirty_ratio);
+    mu_check(bt->GetProperty("fishdb.flusher.nodes", flushed) == BT_OK && flushed > 0);
+
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        int ret = bt->Get(NumKey(i), v);
+        mu_check(live.count(i) ? (ret == BT_OK && v == SizedVal(i)) : ret == BT_NOT_FOUND);
+    }
+    bt->Close();
+    delete bt;
+
+    // ratio 1 keeps everything dirty until eviction
+    options.dirty_ratio = 1;
+    bt = BTree::Open("test19.fdb", options);
+    mu_check(bt->Count() == (int64_t)live.size());
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        int ret = bt->Get(NumKey(i), v);
+        mu_check(live.count(i) ? (ret == BT_OK && v == SizedVal(i)) : ret == BT_NOT_FOUND);
+        if (i % 2 == 0)
+            bt->Put(NumKey(i), v);
+    }
+    mu_check(bt->GetProperty("fishdb.flusher.nodes", flushed) == BT_OK && flushed == 0);
+    bt->Close();
+    bt->Close();
+    delete bt;
+
+    // deleting without Close stops the flusher and vacuum threads and
+    // closes the file
+    options.dirty_ratio = 0.25;
+    bt = BTree::Open("test19.fdb", options);
+    mu_check(bt != NULL);
+    bt->StartVacuum(8, 1);
+    int64_t odd = 0;
+    for (int i = 0; i < N; ++i)
+    {
+        if (i % 2 == 0)
+            bt->Del(NumKey(i));
+        else
+            odd += live.count(i);
+    }
+    delete bt;
+    bt = BTree::Open("test19.fdb", options);
+    mu_check(bt != NULL && bt->Count() == odd);
+    bt->Close();
+    delete bt;
+}
+
+void CopyFile(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(in);
+    fclose(out);
+}
+
+// open what a crash would leave behind, a copy of the file as it is now
+int64_t CrashCount(const char *file, const Options &options, int slot = -1)
+{
+    remove("test20c.fdb");
+    remove("test20c.fdb.warm");
+    CopyFile(file, "test20c.fdb");
+    if (slot >= 0)
+        FlipByte("test20c.fdb", slot * (PG_SIZE / HEADER_SLOTS) + 20);
+    BTree *copy = BTree::Open("test20c.fdb", options);
+    if (copy == NULL) return -1;
+    int64_t cnt = copy->Count();
+    for (int64_t i = 0; i < cnt; ++i)
+    {
+        std::string v;
+        if (copy->Get(NumKey(i), v) != BT_OK || v != NumKey(i))
+            cnt = -2;
+    }
+    copy->Close();
+    delete copy;
+    return cnt;
+}
+
+MU_TEST(test_checkpoint)
+{
+    remove("test20.fdb");
+    remove("test20.fdb.warm");
+    Options options;
+    options.checkpoint_interval_ms = 0;
+    bt = BTree::Open("test20.fdb", options);
+    mu_check(bt != NULL);
+
+    int N = 1000;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+    // the header on disk still describes the empty file
+    mu_check(CrashCount("test20.fdb", options) == 0);
+
+    mu_check(bt->Checkpoint() == BT_OK);
+    mu_check(CrashCount("test20.fdb", options) == N);
+    mu_check(bt->Checkpoint() == BT_OK);
+    int64_t checkpoints = 0;
+    mu_check(bt->GetProperty("fishdb.checkpoints", checkpoints) == BT_OK && checkpoints == 2);
+
+    // a torn header write damages one slot, the other one still opens
+    for (int slot = 0; slot < HEADER_SLOTS; ++slot)
+        mu_check(CrashCount("test20.fdb", options, slot) == N);
+    bt->Close();
+    delete bt;
+
+    // every write call is a checkpoint
+    remove("test20.fdb");
+    remove("test20.fdb.warm");
+    options.sync_mode = SYNC_BATCH;
+    bt = BTree::Open("test20.fdb", options);
+    for (int i = 0; i < 50; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+        if (i % 10 == 9)
+            mu_check(CrashCount("test20.fdb", options) == i + 1);
+    }
+
+    // writes that change nothing dirty no node and are no checkpoint
+    int64_t before = 0, dirty = -1;
+    bt->GetProperty("fishdb.checkpoints", before);
+    std::string cur, val = "x";
+    mu_check(bt->PutIfAbsent(NumKey(3), val, &cur) == BT_CONFLICT);
+    mu_check(bt->CompareAndSwap(NumKey(4), val, val, &cur) == BT_CONFLICT);
+    mu_check(bt->CompareAndSwap(NumKey(99), val, val) == BT_NOT_FOUND);
+    mu_check(bt->Del(NumKey(99)) == BT_NOT_FOUND);
+    mu_check(bt->DeleteRange(NumKey(90), NumKey(99)) == BT_OK);
+    mu_check(bt->GetProperty("fishdb.cache-dirty-pages", dirty) == BT_OK && dirty == 0);
+    mu_check(bt->GetProperty("fishdb.checkpoints", checkpoints) == BT_OK && checkpoints == before);
+    mu_check(bt->Del(NumKey(49)) == BT_OK);
+    mu_check(bt->GetProperty("fishdb.checkpoints", checkpoints) == BT_OK && checkpoints == before + 1);
+    mu_check(CrashCount("test20.fdb", options) == 49);
+    bt->Close();
+    delete bt;
+
+    // nodes evicted after a checkpoint overwrite the pages it uses, the
+    // journal puts them back and a crash opens exactly that checkpoint
+    remove("test20.fdb");
+    remove("test20.fdb.warm");
+    options.sync_mode = SYNC_CHECKPOINT;
+    options.cache_size = 32 << 10;
+    options.dirty_ratio = 1;
+    bt = BTree::Open("test20.fdb", options);
+    N = 3000;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = NumKey(i);
+        bt->Put(NumKey(i), val);
+    }
+    mu_check(bt->Checkpoint() == BT_OK);
+    for (int i = 0; i < N; i += 3)
+    {
+        bt->Put(NumKey(i), val);
+        bt->Del(NumKey(i + 1));
+    }
+    int64_t journaled = 0;
+    mu_check(bt->GetProperty("fishdb.journal.pages", journaled) == BT_OK && journaled > 0);
+    mu_check(CrashCount("test20.fdb", options) == N);
+    bt->Close();
+    delete bt;
+}
+
+// every key and value of a file, in order
+std::string Dump(BTree *tree)
+{
+    std::string out;
+    Iterator *iter = tree->NewIterator();
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next())
+        out += iter->Key() + "=" + iter->Value() + "\n";
+    delete iter;
+    return out;
+}
+
+BTree *OpenCopy(const char *file)
+{
+    std::string warm = std::string(file) + ".warm";
+    remove(warm.c_str());
+    return BTree::Open(file);
+}
+
+MU_TEST(test_backup)
+{
+    remove("test21.fdb");
+    remove("test21.fdb.warm");
+    remove("test21b.fdb");
+    remove("test21c.fdb");
+    Options options;
+    options.checkpoint_interval_ms = 0;
+    bt = BTree::Open("test21.fdb", options);
+    mu_check(bt != NULL);
+    int N = 3000;
+    for (int i = 0; i < N; ++i)
+    {
+        std::string val = SizedVal(i);
+        bt->Put(NumKey(i), val);
+    }
+
+    // a writer goes on during the copy, the backup is one point in time
+    std::atomic<bool> stop(false);
+    std::thread writer([&]()
+    {
+        for (int i = 0; !stop; i = (i + 7) % N)
+        {
+            std::string val = SizedVal(i + 1);
+            bt->Put(NumKey(i), val);
+            bt->Put(NumKey(N + i), val);
+        }
+    });
+    mu_check(bt->Backup("test21b.fdb") == BT_OK);
+    stop = true;
+    writer.join();
+
+    BTree *copy = OpenCopy("test21b.fdb");
+    mu_check(copy != NULL);
+    int64_t cnt = 0;
+    Iterator *iter = copy->NewIterator();
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next(), ++cnt)
+    {
+        int i = atoi(iter->Key().c_str() + 3);
+        if (i < N)
+            mu_check(iter->Value() == SizedVal(i) || iter->Value() == SizedVal(i + 1));
+        else
+            mu_check(iter->Value() == SizedVal(i - N + 1));
+    }
+    delete iter;
+    mu_check(cnt >= N && cnt == copy->Count());
+    for (int i = 0; i < N; ++i)
+    {
+        std::string v;
+        mu_check(copy->Get(NumKey(i), v) == BT_OK);
+    }
+    copy->Close();
+    delete copy;
+
+    // incremental: only what changed since is copied. The first one
+    // catches up with the writer
+    int64_t full = 0, pages = 0, incr = 0;
+    mu_check(bt->Backup("test21b.fdb", true) == BT_OK);
+    bt->GetProperty("fishdb.backup.pages", full);
+    for (int i = 0; i < 20; ++i)
+    {
+        std::string val = "late";
+        bt->Put(NumKey(5 * N + i), val);
+    }
+    mu_check(bt->Backup("test21b.fdb", true) == BT_OK);
+    bt->GetProperty("fishdb.backup.pages", pages);
+    incr = pages - full;
+    int64_t used = 0;
+    bt->GetProperty("fishdb.num-pages", used);
+    mu_check(incr > 0 && incr * 20 < used);
+    copy = OpenCopy("test21b.fdb");
+    mu_check(Dump(copy) == Dump(bt));
+    copy->Close();
+    delete copy;
+
+    // no earlier backup at this path, everything is copied
+    mu_check(bt->Backup("test21c.fdb", true) == BT_OK);
+    bt->GetProperty("fishdb.backup.pages", full);
+    mu_check(full - pages > incr * 20);
+    copy = OpenCopy("test21c.fdb");
+    mu_check(Dump(copy) == Dump(bt));
+    copy->Close();
+    delete copy;
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_merge)
+{
+    remove("test22.fdb");
+    remove("test22.fdb.warm");
+    Options options;
+    options.min_key_num = 4;
+    // decimal counters
+    options.merge_op = [](const std::string &key, const std::string *existing,
+            const std::string &operand, std::string &result)
+    {
+        long long n = existing ? atoll(existing->c_str()) : 0;
+        result = std::to_string(n + atoll(operand.c_str()));
+    };
+    bt = BTree::Open("test22.fdb", options);
+    mu_check(bt != NULL);
+
+    // keys land in inner nodes and leaves alike as the tree grows
+    for (int round = 0; round < 5; ++round)
+        for (int i = 0; i < 500; ++i)
+            mu_check(bt->Merge("ctr" + std::to_string(i), std::to_string(i)) == BT_OK);
+    std::string v = "100";
+    bt->Put("ctr0", v);
+    mu_check(bt->Merge("ctr0", "-1") == BT_OK);
+    mu_check(bt->Count() == 500);
+    bt->Close();
+    delete bt;
+
+    bt = BTree::Open("test22.fdb", options);
+    mu_check(bt != NULL);
+    mu_check(bt->Get("ctr0", v) == BT_OK && v == "99");
+    for (int i = 1; i < 500; ++i)
+        mu_check(bt->Get("ctr" + std::to_string(i), v) == BT_OK && v == std::to_string(5 * i));
+    bt->Close();
+    delete bt;
+
+    // no operator, no merge
+    bt = BTree::Open("test22.fdb");
+    mu_check(bt != NULL);
+    mu_check(bt->Merge("ctr1", "1") == BT_ERROR);
+    mu_check(bt->Get("ctr1", v) == BT_OK && v == "5");
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_conditional_writes)
+{
+    remove("test23.fdb");
+    remove("test23.fdb.warm");
+    Options options;
+    options.min_key_num = 4;
+    bt = BTree::Open("test23.fdb", options);
+    mu_check(bt != NULL);
+
+    std::string cur;
+    for (int i = 0; i < 300; ++i)
+        mu_check(bt->PutIfAbsent("k" + std::to_string(i), "a") == BT_OK);
+    for (int i = 0; i < 300; i += 3)
+    {
+        mu_check(bt->PutIfAbsent("k" + std::to_string(i), "b", &cur) == BT_CONFLICT);
+        mu_check(cur == "a");
+    }
+    mu_check(bt->Count() == 300);
+
+    mu_check(bt->CompareAndSwap("k7", "x", "c", &cur) == BT_CONFLICT && cur == "a");
+    mu_check(bt->CompareAndSwap("k7", "a", "c") == BT_OK);
+    mu_check(bt->CompareAndSwap("none", "a", "c") == BT_NOT_FOUND);
+    mu_check(bt->Get("k7", cur) == BT_OK && cur == "c");
+    mu_check(bt->Get("none", cur) == BT_NOT_FOUND);
+
+    std::string old;
+    mu_check(bt->GetAndSet("k7", "d", old) == BT_OK && old == "c");
+    mu_check(bt->GetAndSet("new", "e", old) == BT_NOT_FOUND);
+    old = "f";
+    mu_check(bt->GetAndSet("k8", old, old) == BT_OK && old == "a");
+    mu_check(bt->Get("k8", cur) == BT_OK && cur == "f");
+    mu_check(bt->Get("new", cur) == BT_OK && cur == "e");
+    mu_check(bt->Count() == 301);
+
+    // lost updates would show as a short count
+    std::string zero = "0";
+    bt->Put("ctr", zero);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.push_back(std::thread([]()
+        {
+            std::string v = "0";
+            for (int i = 0; i < 200; )
+            {
+                if (bt->CompareAndSwap("ctr", v, std::to_string(atoi(v.c_str()) + 1), &v) == BT_OK)
+                {
+                    v = std::to_string(atoi(v.c_str()) + 1);
+                    ++i;
+                }
+            }
+        }));
+    for (size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+    mu_check(bt->Get("ctr", cur) == BT_OK && cur == "800");
+    bt->Close();
+    delete bt;
+
+    options.key_mode = KEY_U64;
+    remove("test23.fdb");
+    bt = BTree::Open("test23.fdb", options);
+    mu_check(bt != NULL);
+    mu_check(bt->PutIfAbsent("abc", "a") == BT_ERROR);
+    mu_check(bt->PutIfAbsent(EncodeU64Key(1), "a") == BT_OK);
+    mu_check(bt->CompareAndSwap(EncodeU64Key(1), "a", "b") == BT_OK);
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_append_split)
+{
+    remove("test24.fdb");
+    remove("test24.fdb.warm");
+    Options options;
+    options.min_key_num = 16;
+    bt = BTree::Open("test24.fdb", options);
+    mu_check(bt != NULL);
+
+    int N = 5000;
+    std::string val = "v";
+    for (int i = 0; i < N; ++i)
+        mu_check(bt->Put(NumKey(i), val) == BT_OK);
+    int64_t nodes = 0, appends = 0;
+    bt->GetProperty("fishdb.num-nodes", nodes);
+    bt->GetProperty("fishdb.node.append.splits", appends);
+    mu_check(appends > 0);
+    mu_check(N > nodes * 32 * 9 / 10);
+
+    // scrambled keys in between fill nodes the usual way
+    for (int j = 0; j < N; ++j)
+        mu_check(bt->Put(NumKey(j * 7 % N) + "x", val) == BT_OK);
+    int64_t splits = 0, later = 0;
+    bt->GetProperty("fishdb.node.splits", splits);
+    bt->GetProperty("fishdb.node.append.splits", later);
+    mu_check(later - appends < (splits - appends) / 10);
+    bt->Close();
+    delete bt;
+
+    bt = BTree::Open("test24.fdb", options);
+    mu_check(bt != NULL);
+    mu_check(bt->Count() == 2 * N);
+    Iterator *iter = bt->NewIterator();
+    int n = 0;
+    for (iter->SeekToLast(); iter->Valid(); iter->Prev())
+        n++;
+    mu_check(n == 2 * N);
+    delete iter;
+    for (int i = 0; i < N; i += 2)
+        mu_check(bt->Del(NumKey(i)) == BT_OK);
+    std::string v;
+    for (int i = 0; i < N; ++i)
+        mu_check(bt->Get(NumKey(i), v) == ((i % 2) ? BT_OK : BT_NOT_FOUND));
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_iter_writes)
+{
+    remove("test26.fdb");
+    remove("test26.fdb.warm");
+    Options options;
+    options.min_key_num = 4;
+    bt = BTree::Open("test26.fdb", options);
+    mu_check(bt != NULL);
+    int N = 2000;
+    std::set<int> keys;
+    for (int i = 0; i < N; i += 2)
+    {
+        std::string val = "v" + NumKey(i);
+        bt->Put(NumKey(i), val);
+        keys.insert(i);
+    }
+
+    // writes between the moves split and shrink the nodes the iterator
+    // stands on, it still walks the keys in order with their own values
+    srand(26);
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        bool forward = pass == 0;
+        auto iter = bt->NewIterator();
+        std::string last;
+        int seen = 0;
+        for (forward ? iter->SeekToFirst() : iter->SeekToLast(); iter->Valid();
+                forward ? iter->Next() : iter->Prev())
+        {
+            std::string key = iter->Key();
+            if (!last.empty())
+                mu_check(forward ? last < key : key < last);
+            mu_check(iter->Value() == "v" + key);
+            last = key;
+            ++seen;
+            for (int j = 0; j < 3; ++j)
+            {
+                int k = rand() % N;
+                std::string val = "v" + NumKey(k);
+                bt->Put(NumKey(k), val);
+                keys.insert(k);
+            }
+            int k = rand() % N;
+            bt->Del(NumKey(k));
+            keys.erase(k);
+        }
+        mu_check(seen > N / 2);
+        delete iter;
+    }
+    mu_check(bt->Count() == (int64_t)keys.size());
+    bt->Close();
+    delete bt;
+}
+
+MU_TEST(test_merge_hysteresis)
+{
+    remove("test25.fdb");
+    remove("test25.fdb.warm");
+    Options options;
+    options.min_key_num = 4;
+    bt = BTree::Open("test25.fdb", options);
+    mu_check(bt != NULL);
+    std::string val = "v";
+    srand(25);
+    std::set<std::string> keys;
+    for (int i = 0; i < 2000; ++i)
+    {
+        std::string key = NumKey(rand() % 10000);
+        keys.insert(key);
+        bt->Put(key, val);
+    }
+
+    // a key going in and out splits its node at most once, the delete
+    // leaves both halves above the merge threshold
+    int64_t splits = 0, merges = 0, later = 0;
+    bt->GetProperty("fishdb.node.splits", splits);
+    bt->GetProperty("fishdb.node.merges", merges);
+    for (int k = 0; k < 10000; k += 200)
+    {
+        for (int round = 0; round < 20; ++round)
+        {
+            mu_check(bt->Put(NumKey(k) + "a", val) == BT_OK);
+            mu_check(bt->Del(NumKey(k) + "a") == BT_OK);
+        }
+    }
+    bt->GetProperty("fishdb.node.splits", later);
+    mu_check(later - splits <= 50);
+    bt->GetProperty("fishdb.node.merges", later);
+    mu_check(later == merges);
+    mu_check(bt->Count() == (int64_t)keys.size());
+
+    // underfull nodes stay correct under random churn
+    for (int i = 0; i < 5000; ++i)
+    {
+        std::string key = NumKey(rand() % 10000);
+        if (rand() % 2)
+        {
+            keys.insert(key);
+            bt->Put(key, val);
+        }
+        else
+            mu_check(bt->Del(key) == (keys.erase(key) ? BT_OK : BT_NOT_FOUND));
+    }
+    bt->Close();
+    delete bt;
+
+    bt = BTree::Open("test25.fdb", options);
+    mu_check(bt != NULL);
+    mu_check(bt->Count() == (int64_t)keys.size());
+    Iterator *iter = bt->NewIterator();
+    auto expect = keys.begin();
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next(), ++expect)
+        mu_check(expect != keys.end() && iter->Key() == *expect);
+    mu_check(expect == keys.end());
+    delete iter;
+    bt->Close();
+    delete bt;
+}
+
 MU_TEST_SUITE(test_suite)
 {
     MU_RUN_TEST(test_btree_simple);
+    MU_RUN_TEST(test_node_entries);
+    MU_RUN_TEST(test_iter_reverse);
+    MU_RUN_TEST(test_delete_range);
+    MU_RUN_TEST(test_order_statistic);
+    MU_RUN_TEST(test_vacuum);
+    MU_RUN_TEST(test_extent_alloc);
+    MU_RUN_TEST(test_checksum);
+    MU_RUN_TEST(test_warmup);
+    MU_RUN_TEST(test_properties);
+    MU_RUN_TEST(test_perf_context);
+    MU_RUN_TEST(test_cache_budget);
+    MU_RUN_TEST(test_comparator);
+    MU_RUN_TEST(test_u64_keys);
+    MU_RUN_TEST(test_parallel_scan);
+    MU_RUN_TEST(test_writeback);
+    MU_RUN_TEST(test_flusher);
+    MU_RUN_TEST(test_checkpoint);
+    MU_RUN_TEST(test_backup);
+    MU_RUN_TEST(test_merge);
+    MU_RUN_TEST(test_conditional_writes);
+    MU_RUN_TEST(test_append_split);
+    MU_RUN_TEST(test_merge_hysteresis);
+    MU_RUN_TEST(test_iter_writes);
     MU_RUN_SUITE(test_encode);
     MU_RUN_SUITE(test_pager);
 }
@@ -3,7 +3,11 @@
 #include <stdint.h>
 #include <string>
 #include <cstring>
+#include <assert.h>
 #include "util.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 namespace fishdb
 {
@@ -83,6 +87,94 @@ int DecodeString(char *buf, std::string &str)
     return 4 + len;
 }
 
+void EncodeU64Key(char *buf, uint64_t num)
+{
+    for (int i = 7; i >= 0; --i, num >>= 8)
+        buf[i] = (char)(num & 0xff);
+}
+
+std::string EncodeU64Key(uint64_t num)
+{
+    char buf[8];
+    EncodeU64Key(buf, num);
+    return std::string(buf, 8);
+}
+
+uint64_t DecodeU64Key(const char *buf)
+{
+    uint64_t num;
+    memcpy(&num, buf, 8);
+    return __builtin_bswap64(num);
+}
+
+uint64_t DecodeU64Key(const std::string &key)
+{
+    assert(key.length() == 8);
+    return DecodeU64Key(key.data());
+}
+
+struct Crc32cTable
+{
+    uint32_t t[256];
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; ++j)
+                crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+            t[i] = crc;
+        }
+    }
+};
+
+uint32_t Crc32cPortable(const char *buf, size_t len, uint32_t crc)
+{
+    static const Crc32cTable table;
+    const uint8_t *p = (const uint8_t *)buf;
+    crc = ~crc;
+    while (len--)
+        crc = table.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSse42(const char *buf, size_t len, uint32_t crc)
+{
+    uint64_t c = ~crc;
+    for (; len >= 8; buf += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len--)
+        c32 = _mm_crc32_u8(c32, (uint8_t)*buf++);
+    return ~c32;
+}
+#endif
+
+bool Crc32cHardware()
+{
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    return hw;
+#else
+    return false;
+#endif
+}
+
+uint32_t Crc32c(const char *buf, size_t len, uint32_t crc)
+{
+#if defined(__x86_64__)
+    if (Crc32cHardware())
+        return Crc32cSse42(buf, len, crc);
+#endif
+    return Crc32cPortable(buf, len, crc);
+}
+
 }
 
 #endif
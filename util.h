@@ -21,6 +21,17 @@ int DecodeInt32(char *buf, int32_t &num);
 int DecodeInt64(char *buf, int64_t &num);
 int DecodeString(char *buf, std::string &str);
 
+// big-endian, so bytewise order is numeric order
+std::string EncodeU64Key(uint64_t num);
+void EncodeU64Key(char *buf, uint64_t num);
+uint64_t DecodeU64Key(const std::string &key);
+uint64_t DecodeU64Key(const char *buf);
+
+// CRC32C (Castagnoli), SSE4.2 crc32 when the cpu has it
+uint32_t Crc32c(const char *buf, size_t len, uint32_t crc = 0);
+uint32_t Crc32cPortable(const char *buf, size_t len, uint32_t crc = 0);
+bool Crc32cHardware();
+
 }
 
 #endif